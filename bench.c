@@ -0,0 +1,203 @@
+#include "editor.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Benchmark configuration. */
+#define BENCH_ROWS 24
+#define BENCH_COLS 80
+
+/* Number of times each operation of a script is repeated. */
+#define BENCH_OPS 1000
+
+/* Number of lines in each pasted block. */
+#define BENCH_PASTE_LINES 100
+
+/* Length of the single line of the file for the long line scripts, and the
+ * distance between the tabs in it. */
+#define BENCH_LINE_LEN (64 << 20)
+#define BENCH_LINE_TAB 64
+
+/* Recorded keys. The setup keys are replayed before the operation is timed
+ * BENCH_OPS times, each followed by a frame, and the teardown keys after. */
+struct bench_script {
+  const char *name;
+  const char *setup;
+  const char *op;
+  const char *teardown;
+};
+
+/* Returns the time in microseconds. */
+static double bench_now() { return stats_now() / 1e3; }
+
+static int bench_compare(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Creates an empty file to write the benchmarked file to. Its path is kept
+ * in path. */
+static FILE *bench_create(char *path) {
+  memcpy(path + strlen(path) - 6, "XXXXXX", 6);
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    fprintf(stderr, "vip-bench: cannot create file\n");
+    exit(1);
+  }
+  return fdopen(fd, "w");
+}
+
+/* Writes a file of the provided number of lines, some of them indented with
+ * tabs, and returns its path. */
+static char *bench_generate(size_t lines) {
+  static char path[] = "/tmp/vip-bench-XXXXXX";
+  FILE *fp = bench_create(path);
+  for (size_t i = 0; i < lines; i++)
+    fprintf(fp, "%sline %zu: the quick brown fox jumps over the lazy dog\n",
+            i % 8 == 0 ? "\t" : "", i);
+  fclose(fp);
+  return path;
+}
+
+/* Writes a file of a single line of the provided length, with a tab every
+ * BENCH_LINE_TAB characters, and returns its path. */
+static char *bench_generate_line(size_t len) {
+  static char path[] = "/tmp/vip-bench-XXXXXX";
+  FILE *fp = bench_create(path);
+  char run[BENCH_LINE_TAB];
+  memset(run, 'x', sizeof(run));
+  run[0] = '\t';
+  for (size_t i = 0; i < len; i += sizeof(run))
+    fwrite(run, 1, len - i < sizeof(run) ? len - i : sizeof(run), fp);
+  fputc('\n', fp);
+  fclose(fp);
+  return path;
+}
+
+/* Feeds the keys through the input path as if they arrived in one read, then
+ * draws a frame into the render buffer. The frame is discarded instead of
+ * being written to a terminal. Returns the size of the frame in bytes. */
+static int bench_feed(struct editor *E, const char *keys) {
+  size_t len = strlen(keys);
+  memcpy(E->input, keys, len);
+  E->input_start = 0;
+  E->input_len = len;
+  while (E->input_len > 0)
+    editor_process_input(E);
+
+  editor_draw(E);
+  int bytes = E->render_buffer.len;
+  E->render_buffer.len = 0;
+  return bytes;
+}
+
+static void bench_run(struct editor *E, struct bench_script *script) {
+  static double latencies[BENCH_OPS];
+  size_t bytes = 0;
+
+  bench_feed(E, script->setup);
+  uint64_t allocs = stats.mallocs + stats.reallocs;
+  for (int i = 0; i < BENCH_OPS; i++) {
+    double start = bench_now();
+    bytes += bench_feed(E, script->op);
+    latencies[i] = bench_now() - start;
+  }
+  allocs = stats.mallocs + stats.reallocs - allocs;
+  bench_feed(E, script->teardown);
+
+  qsort(latencies, BENCH_OPS, sizeof(double), bench_compare);
+  printf("  %-12s %10.1f %10.1f %12.1f %10.2f\n", script->name,
+         latencies[BENCH_OPS / 2], latencies[BENCH_OPS * 99 / 100],
+         (double)bytes / BENCH_OPS, (double)allocs / BENCH_OPS);
+}
+
+/* Runs the scripts on the file at path, which is described by what. */
+static void bench_file(char *path, const char *what,
+                       struct bench_script *scripts, int n) {
+  struct editor E = {0};
+  double start = bench_now();
+  editor_open_file(&E, path);
+  double open_time = bench_now() - start;
+  file_load_wait(E.file);
+  editor_load(&E);
+  double load_time = bench_now() - start;
+  unlink(path);
+
+  editor_init_screen(&E, BENCH_ROWS, BENCH_COLS);
+  bench_feed(&E, "");
+
+  printf("%s, opened in %.1f ms, read in %.1f ms\n", what, open_time / 1e3,
+         load_time / 1e3);
+  printf("  %-12s %10s %10s %12s %10s\n", "script", "p50 us", "p99 us",
+         "bytes/frame", "allocs/op");
+  for (int i = 0; i < n; i++)
+    bench_run(&E, &scripts[i]);
+
+  start = bench_now();
+  file_close(E.file);
+  printf("  closed in %.1f ms\n", (bench_now() - start) / 1e3);
+  undo_free(&E.undo);
+  for (size_t i = 0; i < E.register_len; i++)
+    file_line_free(&E.register_lines[i]);
+  free(E.register_lines);
+  search_free(&E.search);
+  search_free(&E.search_typed);
+  render_screen_free(&E.screen);
+  render_buffer_free(&E.render_buffer);
+}
+
+int main(int argc, char *argv[]) {
+  /* A paste of BENCH_PASTE_LINES lines, made once up front. */
+  static char paste[BENCH_PASTE_LINES * 16];
+  int len = sprintf(paste, "\033%s", RENDER_PASTE_START);
+  for (int i = 0; i < BENCH_PASTE_LINES; i++)
+    len += sprintf(&paste[len], "pasted %d\r", i);
+  sprintf(&paste[len], "\033%s", RENDER_PASTE_END);
+
+  struct bench_script scripts[] = {
+      {"down", "", "j", ""},
+      {"up", "", "k", ""},
+      {"insert", "i", "a", "\033"},
+      {"split", "i", "\r", "\033"},
+      {"join", "i", "\x7f", "\033"},
+      {"delete", "", "x", "9999h"},
+      {"delete-line", "", "dd", ""},
+      {"jump", "", "1000j", ""},
+      {"page-down", "gg", "\x06", ""},
+      {"half-page", "gg", "\x04", ""},
+      {"delete-lines", "", "100dd", ""},
+      {"undo-redo", "100dd", "u\x12", ""},
+      {"paste", "", paste, ""},
+      {"yank", "", "100yy", ""},
+      {"put", "100yy", "p", ""},
+      {"search", "/00000:\r", "n", ":noh\r"},
+  };
+  int n = sizeof(scripts) / sizeof(scripts[0]);
+
+  /* Scripts moving and typing in a single long line, which should cost as
+   * little as in a short one. A counted h reaches the start of the line and
+   * leaving an append its end. */
+  struct bench_script line_scripts[] = {
+      {"line-right", "99999999h", "l", ""},
+      {"line-left", "A\033", "h", ""},
+      {"line-append", "A", "a", "\033"},
+      {"line-delete", "A\033", "x", ""},
+  };
+  int line_n = sizeof(line_scripts) / sizeof(line_scripts[0]);
+
+  static size_t sizes[] = {1000, 1000000, 10000000};
+  size_t sizes_len = argc < 2 ? sizeof(sizes) / sizeof(sizes[0]) : argc - 1;
+  for (size_t i = 0; i < sizes_len; i++) {
+    size_t lines = argc < 2 ? sizes[i] : strtoull(argv[i + 1], NULL, 10);
+    char what[64];
+    snprintf(what, sizeof(what), "%zu lines", lines);
+    bench_file(bench_generate(lines), what, scripts, n);
+  }
+
+  char what[64];
+  snprintf(what, sizeof(what), "1 line of %d MB", BENCH_LINE_LEN >> 20);
+  bench_file(bench_generate_line(BENCH_LINE_LEN), what, line_scripts, line_n);
+  return 0;
+}
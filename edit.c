@@ -1,34 +1,118 @@
 #include "edit.h"
+#include "stats.h"
 #include <stdlib.h>
 #include <string.h>
 
-void edit_insert_char(char **string, size_t *len, int pos, char c) {
-  *string = realloc(*string, *len + 2);
-  memcpy(*string + pos + 1, *string + pos, *len - pos);
-  (*string)[pos] = c;
-  (*string)[++(*len)] = '\0';
+/* Smallest buffer allocated for an edited line. */
+#define EDIT_MIN_CAP 16
+
+/* Makes room for len characters plus the terminating NUL, len being at most
+ * LINE_LEN_MAX. The buffer grows geometrically so that runs of inserts only
+ * reallocate O(log n) times, up to the size of the longest line. Lines that
+ * still point into the file mapping or share their characters get their own
+ * copy of them the first time they are edited. */
+static void edit_reserve(struct line *line, size_t len) {
+  int owned = line->cap > 0 && line->cap != LINE_SHARED;
+  if (owned && line->cap > len)
+    return;
+
+  size_t cap = owned && line->cap > EDIT_MIN_CAP ? line->cap : EDIT_MIN_CAP;
+  while (cap <= len)
+    cap *= 2;
+  if (cap > (size_t)LINE_LEN_MAX + 1)
+    cap = (size_t)LINE_LEN_MAX + 1;
+
+  if (!owned) {
+    char *chars = malloc(cap);
+    memcpy(chars, line->chars, line->len < len ? line->len : len);
+    file_line_free(line);
+    line->chars = chars;
+  } else {
+    line->chars = realloc(line->chars, cap);
+  }
+  line->cap = cap;
+}
+
+/* Edits that add or remove no tabs keep the tab positions cached for the line
+ * up to date, since finding them again costs as much as the whole line. */
+
+void edit_insert_char(struct line *line, int pos, char c) {
+  STATS_COUNT(edits);
+  if (c == '\t')
+    file_line_changed(line);
+  else
+    file_line_shift(line, pos, 1);
+  edit_reserve(line, line->len + 1);
+  memmove(line->chars + pos + 1, line->chars + pos, line->len - pos);
+  line->chars[pos] = c;
+  line->chars[++line->len] = '\0';
 }
 
-void edit_delete_char(char **string, size_t *len, int pos) {
-  memcpy(*string + pos, *string + pos + 1, *len - pos);
-  (*string)[--(*len)] = '\0';
-  *string = realloc(*string, *len + 1);
+void edit_insert_string(struct line *line, int pos, const char *s, size_t len) {
+  STATS_COUNT(edits);
+  if (memchr(s, '\t', len))
+    file_line_changed(line);
+  else
+    file_line_shift(line, pos, len);
+  edit_reserve(line, line->len + len);
+  memmove(line->chars + pos + len, line->chars + pos, line->len - pos);
+  memcpy(line->chars + pos, s, len);
+  line->len += len;
+  line->chars[line->len] = '\0';
 }
 
-char *edit_split_string(char **string, size_t *len, int pos) {
-  int new_len = *len - pos;
+void edit_delete_char(struct line *line, int pos) {
+  STATS_COUNT(edits);
+  if (line->chars[pos] == '\t')
+    file_line_changed(line);
+  else
+    file_line_shift(line, pos, -1);
+  edit_reserve(line, line->len);
+  memmove(line->chars + pos, line->chars + pos + 1, line->len - pos - 1);
+  line->chars[--line->len] = '\0';
+}
+
+void edit_delete_string(struct line *line, int pos, size_t len) {
+  STATS_COUNT(edits);
+  if (memchr(line->chars + pos, '\t', len))
+    file_line_changed(line);
+  else
+    file_line_shift(line, pos, -(long)len);
+  edit_reserve(line, line->len);
+  memmove(line->chars + pos, line->chars + pos + len, line->len - pos - len);
+  line->len -= len;
+  line->chars[line->len] = '\0';
+}
+
+char *edit_split_string(struct line *line, int pos) {
+  STATS_COUNT(edits);
+  file_line_cut(line, pos);
+  int new_len = line->len - pos;
   char *new = malloc(new_len + 1);
-  memcpy(new, *string + pos, new_len);
+  memcpy(new, line->chars + pos, new_len);
   new[new_len] = '\0';
 
-  *string = realloc(*string, pos + 1);
-  (*string)[pos] = '\0';
-  *len = pos;
+  edit_reserve(line, pos);
+  line->chars[pos] = '\0';
+  line->len = pos;
   return new;
 }
 
-void edit_append_string(char **string, size_t *len, char *astring, size_t alen) {
-  *string = realloc(*string, *len + alen + 1);
-  memcpy(*string + *len, astring, alen + 1);
-  *len += alen;
+void edit_append_string(struct line *line, const char *astring, size_t alen) {
+  STATS_COUNT(edits);
+  if (memchr(astring, '\t', alen))
+    file_line_changed(line);
+  edit_reserve(line, line->len + alen);
+  memcpy(line->chars + line->len, astring, alen);
+  line->len += alen;
+  line->chars[line->len] = '\0';
+}
+
+void edit_set_string(struct line *line, char *chars, size_t len, size_t cap) {
+  STATS_COUNT(edits);
+  file_line_changed(line);
+  file_line_free(line);
+  line->chars = chars;
+  line->len = len;
+  line->cap = cap;
 }
@@ -1,16 +1,29 @@
 #ifndef _EDIT_H_
 #define _EDIT_H_
 
+#include "file.h"
 #include <string.h>
 
-/* Inserts a character at the provided position in the provided string and
+/* Inserts a character at the provided position in the provided line and
  * updates the length. */
-void edit_insert_char(char **string, size_t *len, int pos, char c);
+void edit_insert_char(struct line *line, int pos, char c);
 
-void edit_delete_char(char **string, size_t *len, int pos);
+/* Inserts the first len characters of the provided string at the provided
+ * position in the provided line. */
+void edit_insert_string(struct line *line, int pos, const char *s, size_t len);
 
-char *edit_split_string(char **string, size_t *len, int pos);
+void edit_delete_char(struct line *line, int pos);
 
-void edit_append_string(char **string, size_t *len, char *astring, size_t alen);
+/* Deletes len characters from the provided position in the provided line. */
+void edit_delete_string(struct line *line, int pos, size_t len);
+
+char *edit_split_string(struct line *line, int pos);
+
+void edit_append_string(struct line *line, const char *astring, size_t alen);
+
+/* Replaces the characters of the provided line with chars, which holds len
+ * characters and a terminating NUL in cap bytes. The line takes ownership of
+ * chars. */
+void edit_set_string(struct line *line, char *chars, size_t len, size_t cap);
 
 #endif /* _EDIT_H_ */
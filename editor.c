@@ -0,0 +1,1559 @@
+#include "edit.h"
+#include "editor.h"
+#include "replace.h"
+#include "split.h"
+#include "stats.h"
+#include "swap.h"
+#include "undo.h"
+#include <ctype.h>
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Key sent for the provided letter pressed with control. */
+#define CTRL_KEY(k) ((k) & 0x1f)
+
+/* Events watched on a followed file, and on its directory for when a file is
+ * created in place of it. */
+#define FOLLOW_FILE_EVENTS (IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF)
+#define FOLLOW_DIR_EVENTS (IN_CREATE | IN_MOVED_TO)
+
+/* Returns a row or length of the file as a screen or cursor position, which
+ * are kept as int, clamped to INT_MAX. */
+static int editor_clamp(size_t n) { return n < INT_MAX ? (int)n : INT_MAX; }
+
+void editor_open_file(struct editor *E, char *filename) {
+  E->file = file_open(filename);
+  E->filename = filename;
+  E->load_percent = file_load(E->file);
+}
+
+void editor_init_screen(struct editor *E, int rows, int cols) {
+  E->screen_lines = rows - 1;
+  E->screen_cols = cols;
+  render_screen_init(&E->screen, rows, cols);
+}
+
+/* Replaces the lines of the register with the n provided lines, taking
+ * ownership of them and of the array. */
+void editor_set_register(struct editor *E, struct line *lines, size_t n) {
+  for (size_t i = 0; i < E->register_len; i++)
+    file_line_free(&E->register_lines[i]);
+  free(E->register_lines);
+  E->register_lines = lines;
+  E->register_len = n;
+}
+
+void editor_close(struct editor *E) {
+  render_set_bracketed_paste(&E->render_buffer, 0);
+  render_clear_screen(&E->render_buffer);
+  render_set_cursor_home(&E->render_buffer);
+  render_buffer_write(&E->render_buffer);
+
+  file_close(E->file);
+  swap_close(E->swap, 1);
+  if (E->follow)
+    close(E->follow_fd);
+  undo_free(&E->undo);
+  editor_set_register(E, NULL, 0);
+  search_free(&E->search);
+  search_free(&E->search_typed);
+  render_screen_free(&E->screen);
+  render_buffer_free(&E->render_buffer);
+}
+
+/* Returns the line under the cursor. */
+struct line *editor_line(struct editor *E) {
+  return file_line(E->file, E->file_cursor_row);
+}
+
+/* Marks the screen rows showing the file rows from up to, but not including,
+ * to as changed, and the searches' knowledge of them as out of date. */
+void editor_touch_rows(struct editor *E, int from, int to) {
+  render_screen_touch(&E->screen, from - E->render_row_offset,
+                      to - E->render_row_offset);
+  search_forget(&E->search, from, to);
+  search_forget(&E->search_typed, from, to);
+}
+
+/* Updates the screen after n rows were inserted into the file at the provided
+ * row, or -n rows were deleted from it. */
+void editor_shift_rows(struct editor *E, int at, int n) {
+  search_forget_all(&E->search);
+  search_forget_all(&E->search_typed);
+
+  int row = at - E->render_row_offset;
+  if (row < 0)
+    render_screen_touch(&E->screen, 0, E->screen_lines);
+  else
+    render_screen_scroll(&E->screen, row, E->screen_lines - 1, -n);
+}
+
+void editor_load(struct editor *E) {
+  size_t len = E->file->len;
+  E->load_percent = file_load(E->file);
+  editor_touch_rows(E, len, E->file->len);
+}
+
+/* Records the pending step before a change is made. */
+static void editor_change(struct editor *E) {
+  if (!E->step_pending)
+    return;
+  E->step_pending = 0;
+  undo_step(&E->undo, E->step_row, E->step_col, ++E->steps);
+  swap_write(E->swap, SWAP_STEP, E->step_row, E->step_col, E->steps, NULL, 0);
+}
+
+/* Inserts len characters of s into the row at the provided column. Returns 0
+ * without changing it if the row would get longer than LINE_LEN_MAX. */
+int editor_insert_text(struct editor *E, int row, int col, const char *s,
+                       size_t len) {
+  if (len > LINE_LEN_MAX - file_line(E->file, row)->len)
+    return 0;
+  editor_change(E);
+  edit_insert_string(file_line(E->file, row), col, s, len);
+  undo_insert_text(&E->undo, row, col, s, len);
+  swap_write(E->swap, SWAP_INSERT_TEXT, row, col, 0, s, len);
+  editor_touch_rows(E, row, row + 1);
+  return 1;
+}
+
+/* Deletes len characters from the row at the provided column. */
+void editor_delete_text(struct editor *E, int row, int col, size_t len) {
+  editor_change(E);
+  struct line *line = file_line(E->file, row);
+  undo_delete_text(&E->undo, row, col, line->chars + col, len);
+  edit_delete_string(line, col, len);
+  swap_write(E->swap, SWAP_DELETE_TEXT, row, col, len, NULL, 0);
+  editor_touch_rows(E, row, row + 1);
+}
+
+/* Moves the end of the row from the provided column to a new row below it. */
+void editor_split_row(struct editor *E, int row, int col) {
+  editor_change(E);
+  file_split_row(E->file, row, col);
+  undo_split(&E->undo, row, col);
+  swap_write(E->swap, SWAP_SPLIT, row, col, 0, NULL, 0);
+  editor_touch_rows(E, row, row + 1);
+  editor_shift_rows(E, row + 1, 1);
+}
+
+/* Appends the row below the provided row to it. Returns 0 without changing
+ * them if the row would get longer than LINE_LEN_MAX. */
+int editor_join_row(struct editor *E, int row) {
+  struct line *line = file_line(E->file, row);
+  struct line *next = file_line(E->file, row + 1);
+  if (next->len > LINE_LEN_MAX - line->len)
+    return 0;
+  editor_change(E);
+  undo_join(&E->undo, row, line->len);
+  edit_append_string(line, next->chars, next->len);
+  file_delete_row(E->file, row + 1);
+  swap_write(E->swap, SWAP_JOIN, row, 0, 0, NULL, 0);
+  editor_touch_rows(E, row, row + 1);
+  editor_shift_rows(E, row + 1, -1);
+  return 1;
+}
+
+/* Deletes n rows from the provided row. The lines are kept to undo it, and
+ * in the register. */
+void editor_delete_rows(struct editor *E, size_t row, size_t n) {
+  editor_change(E);
+  /* Deleting every row leaves an empty one in their place. */
+  size_t count = n == E->file->len ? 1 : 0;
+  struct line *lines = malloc(sizeof(struct line) * n);
+  struct line *shared = malloc(sizeof(struct line) * n);
+  file_take_rows(E->file, row, n, lines);
+  for (size_t i = 0; i < n; i++)
+    shared[i] = file_share_line(&lines[i]);
+  editor_set_register(E, shared, n);
+  undo_rows(&E->undo, row, lines, n, count);
+  swap_write(E->swap, SWAP_DELETE_ROWS, row, 0, n, NULL, 0);
+  editor_shift_rows(E, row, -editor_clamp(n - count));
+}
+
+/* Copies n rows from the provided row to the register. The lines share the
+ * characters of the rows, so no text is copied. */
+void editor_yank_rows(struct editor *E, size_t row, size_t n) {
+  struct line *lines = malloc(sizeof(struct line) * n);
+  struct line *run = NULL;
+  size_t run_len = 0;
+  for (size_t i = 0; i < n; i++, run++, run_len--) {
+    if (run_len == 0)
+      run = file_lines(E->file, row + i, &run_len);
+    lines[i] = file_share_line(run);
+  }
+  editor_set_register(E, lines, n);
+  swap_write(E->swap, SWAP_YANK, row, 0, n, NULL, 0);
+}
+
+/* Puts the lines of the register count times below the provided row, or
+ * above it if before is set. The new rows share the characters of the
+ * register, so no text is copied. Returns 0 without changing the file if the
+ * file would get more than INT_MAX rows or there is no memory for them. */
+int editor_put(struct editor *E, int row, int before, int count) {
+  if (E->register_len == 0 || count <= 0)
+    return 1;
+  if (E->file->len > INT_MAX ||
+      E->register_len > (INT_MAX - E->file->len) / count)
+    return 0;
+  size_t n = E->register_len * count;
+  struct line *lines = malloc(sizeof(struct line) * n);
+  if (!lines)
+    return 0;
+
+  editor_change(E);
+  int at = before ? row : row + 1;
+  for (size_t i = 0; i < n; i++)
+    lines[i] = file_share_line(&E->register_lines[i % E->register_len]);
+  file_insert_rows(E->file, at, lines, n);
+  free(lines);
+  undo_rows(&E->undo, at, NULL, 0, n);
+  swap_write(E->swap, SWAP_PUT, row, before, count, NULL, 0);
+  editor_shift_rows(E, at, n);
+  return 1;
+}
+
+/* Starts an undo step for the changes made from the provided position. Nothing
+ * is recorded until the first of them is made, so commands that turn out to
+ * change nothing leave no step behind. */
+void editor_start_step(struct editor *E, int row, int col) {
+  E->step_pending = 1;
+  E->step_row = row;
+  E->step_col = col;
+}
+
+/* Journals the rows changed by undoing or redoing a step as they are now. */
+static void editor_journal_rows(void *arg, size_t row, size_t removed,
+                                size_t added) {
+  struct editor *E = arg;
+  size_t len = 0;
+  for (size_t i = 0; i < added; i++)
+    len += file_line(E->file, row + i)->len + 1;
+  char *text = malloc(len), *p = text;
+  for (size_t i = 0; i < added; i++) {
+    struct line *line = file_line(E->file, row + i);
+    memcpy(p, line->chars, line->len);
+    p += line->len;
+    *p++ = '\n';
+  }
+  swap_write(E->swap, SWAP_ROWS, row, added, removed, text, len);
+  free(text);
+}
+
+/* Undoes the last step, or redoes the last step undone if redo is set, and
+ * stores where the cursor goes in *row and *col. Returns 0 if there is no
+ * step to undo or redo. */
+static int editor_undo(struct editor *E, int redo, size_t *row, size_t *col) {
+  size_t step = undo_next(&E->undo, redo);
+  if (step == 0)
+    return 0;
+
+  swap_write(E->swap, redo ? SWAP_REDO : SWAP_UNDO, step, 0, 0, NULL, 0);
+  undo_changed *changed =
+      E->swap && step <= E->steps_saved ? editor_journal_rows : NULL;
+  if (redo)
+    return undo_redo(&E->undo, E->file, row, col, changed, E);
+  return undo_undo(&E->undo, E->file, row, col, changed, E);
+}
+
+/* Scrolls the view so the cursor is on the screen. */
+void editor_scroll(struct editor *E) {
+  int n = 0;
+  if (E->file_cursor_row < E->render_row_offset)
+    n = E->file_cursor_row - E->render_row_offset;
+  else if (E->file_cursor_row >= E->render_row_offset + E->screen_lines)
+    n = E->file_cursor_row - (E->render_row_offset + E->screen_lines - 1);
+
+  if (n != 0) {
+    E->render_row_offset += n;
+    render_screen_scroll(&E->screen, 0, E->screen_lines - 1, n);
+  }
+
+  /* Terminals cannot scroll sideways, so every row is written again when the
+   * view moves. It centers the cursor to make room before the next move. */
+  int col = E->render_cursor_col;
+  if (col < E->render_col_offset ||
+      col >= E->render_col_offset + E->screen_cols) {
+    E->render_col_offset = col > E->screen_cols / 2 ? col - E->screen_cols / 2
+                                                    : 0;
+    render_screen_touch(&E->screen, 0, E->screen_lines);
+  }
+}
+
+/* Scrolls the view down by n rows, or up if n is negative, without going past
+ * either end of the file. Returns the number of rows scrolled. */
+int editor_scroll_view(struct editor *E, int n) {
+  size_t len = E->file->len, lines = E->screen_lines;
+  int max = editor_clamp(len > lines ? len - lines : 0);
+  int offset = E->render_row_offset;
+  if (n > 0)
+    offset = n <= max - offset ? offset + n : max > offset ? max : offset;
+  else
+    offset = -n <= offset ? offset + n : 0;
+
+  n = offset - E->render_row_offset;
+  if (n != 0) {
+    E->render_row_offset = offset;
+    render_screen_scroll(&E->screen, 0, E->screen_lines - 1, n);
+  }
+  return n;
+}
+
+/* Shows the message until the next key. Messages with several lines cover the
+ * rows above the command line. */
+void editor_set_message(struct editor *E, const char *message) {
+  snprintf(E->message, MESSAGE_SIZE, "%s", message);
+  E->message_rows = 1;
+  for (const char *p = E->message; (p = strchr(p, '\n')) != NULL; p++)
+    E->message_rows++;
+  if (E->message_rows > E->screen_lines + 1)
+    E->message_rows = E->screen_lines + 1;
+}
+
+/* Removes the message and marks the rows it covered for redrawing. */
+void editor_clear_message(struct editor *E) {
+  render_screen_touch(&E->screen, E->screen_lines - E->message_rows + 1,
+                      E->screen_lines);
+  E->message[0] = '\0';
+  E->message_rows = 0;
+}
+
+/* Journals the end of the save started at save_time and save_offset, if it
+ * succeeded, or tells the user that it failed. */
+static int editor_save_done(struct editor *E, int result) {
+  if (result == -1) {
+    char message[MESSAGE_SIZE];
+    snprintf(message, sizeof(message), "Cannot write %s", E->filename);
+    editor_set_message(E, message);
+    return -1;
+  }
+  swap_write(E->swap, SWAP_SAVE, E->save_time.tv_sec, E->save_time.tv_nsec,
+             E->save_offset, NULL, 0);
+  swap_sync(E->swap);
+  return 0;
+}
+
+int editor_save_file(struct editor *E, char *filename) {
+  editor_check_save(E, 1);
+
+  /* Recovery tells from the time of the save which changes the file holds,
+   * and starts with the register as it was then. The steps made before it
+   * are counted as saved even if it fails, which only journals more rows. */
+  clock_gettime(CLOCK_REALTIME, &E->save_time);
+  E->save_offset = swap_offset(E->swap);
+  E->steps_saved = E->steps;
+  for (size_t i = 0; E->swap && i < E->register_len; i++)
+    swap_write(E->swap, SWAP_REGISTER, i, 0, 0, E->register_lines[i].chars,
+               E->register_lines[i].len);
+
+  if (!SAVE_IN_BACKGROUND)
+    return editor_save_done(E, file_save(E->file, filename));
+  if (file_save_async(E->file, filename) == -1)
+    return editor_save_done(E, -1);
+  E->saving = 1;
+  return 0;
+}
+
+int editor_check_save(struct editor *E, int wait) {
+  if (!E->saving || (!wait && !file_save_done(E->file)))
+    return 0;
+  E->saving = 0;
+  return editor_save_done(E, file_save_wait(E->file));
+}
+
+/* Returns 1 if the file can be edited, and otherwise tells the user why
+ * not. */
+int editor_writable(struct editor *E) {
+  if (!E->file->index && !E->follow)
+    return 1;
+
+  editor_set_message(E, E->follow ? "Followed files are opened read-only"
+                                  : "Large files are opened read-only");
+  return 0;
+}
+
+/* Draws the first len characters of s into the provided screen row. */
+void editor_draw_text(struct editor *E, int row, const char *s, size_t len) {
+  struct line line = {(char *)s, len, 0, NULL};
+  render_row(&E->screen, row, &line, 0, TAB_STOP);
+  file_line_changed(&line);
+}
+
+/* Draws the command line and the message over it. They are drawn every frame,
+ * which costs nothing to flush when they have not changed. */
+void editor_draw_status(struct editor *E) {
+  int status_row = E->screen_lines;
+  if (E->message_rows > 0) {
+    const char *p = E->message;
+    for (int row = status_row - E->message_rows + 1; row <= status_row; row++) {
+      const char *eol = strchr(p, '\n');
+      size_t len = eol ? (size_t)(eol - p) : strlen(p);
+      editor_draw_text(E, row, p, len);
+      p += eol ? len + 1 : len;
+    }
+  } else if (E->mode == MODE_COMMAND || E->mode == MODE_SEARCH) {
+    char prompt = E->mode == MODE_COMMAND ? ':' : E->search_forward ? '/' : '?';
+    char command[COMMAND_SIZE + 1];
+    int len = snprintf(command, sizeof(command), "%c%.*s", prompt,
+                       E->command_len, E->command);
+    editor_draw_text(E, status_row, command, len);
+  } else if (E->load_percent < 100) {
+    char loading[32];
+    int len = snprintf(loading, sizeof(loading), "Loading... %d%%",
+                       E->load_percent);
+    editor_draw_text(E, status_row, loading, len);
+  } else {
+    editor_draw_text(E, status_row, "", 0);
+  }
+}
+
+/* Returns the search whose matches are highlighted, or NULL if there is
+ * none. */
+struct search *editor_shown_search(struct editor *E) {
+  if (E->mode == MODE_SEARCH)
+    return &E->search_typed;
+  return E->search_highlight ? &E->search : NULL;
+}
+
+/* Highlights the matches of the shown search in the provided screen row, which
+ * shows line. Only the part of the line on the screen is searched. */
+void editor_draw_matches(struct editor *E, int row, struct line *line) {
+  struct search *search = editor_shown_search(E);
+  int offset = E->render_col_offset;
+  if (!search || search->len == 0 || line->len == 0 ||
+      render_line_col(line, line->len, TAB_STOP) <= offset)
+    return;
+
+  /* Matches that start before the screen and end on it count too. */
+  size_t start = render_line_file_col(line, offset, TAB_STOP);
+  size_t end = render_line_file_col(line, offset + E->screen_cols, TAB_STOP);
+  start = start >= search->len ? start - (search->len - 1) : 0;
+  end = line->len - end > search->len ? end + search->len : line->len;
+  struct line window = {line->chars + start, end - start, 0, NULL};
+
+  for (long at = search_line(search, &window, 0); at >= 0;
+       at = search_line(search, &window, at + search->len)) {
+    render_row_attr(
+        &E->screen, row, render_line_col(line, start + at, TAB_STOP) - offset,
+        render_line_col(line, start + at + search->len, TAB_STOP) - offset,
+        RENDER_ATTR_MATCH);
+  }
+}
+
+/* Marks every row showing the file as changed, for when the highlighted
+ * matches change. */
+void editor_touch_screen(struct editor *E) {
+  render_screen_touch(&E->screen, 0, E->screen_lines);
+}
+
+void editor_draw(struct editor *E) {
+  editor_scroll(E);
+
+  for (int row = 0; row < E->screen_lines; row++) {
+    if (!E->screen.dirty[row])
+      continue;
+
+    size_t file_row = (size_t)E->render_row_offset + row;
+    struct line *line =
+        file_row < E->file->len ? file_line(E->file, file_row) : NULL;
+    render_row(&E->screen, row, line, E->render_col_offset, TAB_STOP);
+    if (line)
+      editor_draw_matches(E, row, line);
+  }
+
+  editor_draw_status(E);
+
+  if (E->mode == MODE_COMMAND || E->mode == MODE_SEARCH)
+    render_screen_flush(&E->screen, &E->render_buffer, E->screen_lines,
+                        E->command_len + 1);
+  else
+    render_screen_flush(&E->screen, &E->render_buffer,
+                        E->file_cursor_row - E->render_row_offset,
+                        E->render_cursor_col - E->render_col_offset);
+}
+
+void editor_refresh(struct editor *E) {
+  STATS_START(start);
+  editor_draw(E);
+  render_buffer_write(&E->render_buffer);
+  STATS_STOP(frame_ns, start);
+}
+
+/* Waits up to timeout milliseconds, or indefinitely if timeout is negative,
+ * for input and reads everything available into the input buffer. Returns the
+ * number of bytes read, 0 on timeout or if the buffer is full and -1 on
+ * error. */
+int editor_fill_input(struct editor *E, int timeout) {
+  if (E->input_start > 0) {
+    memmove(E->input, &E->input[E->input_start], E->input_len);
+    E->input_start = 0;
+  }
+  if (E->input_len == INPUT_BUFFER_SIZE)
+    return 0;
+
+  /* Changes to a followed file wake the wait up too, and are only noted to be
+   * read later. */
+  struct pollfd pfd[2] = {{STDIN_FILENO, POLLIN, 0},
+                          {E->follow ? E->follow_fd : -1, POLLIN, 0}};
+  int ready;
+  while ((ready = poll(pfd, 2, timeout)) == -1)
+    if (errno != EINTR)
+      return -1;
+  if (pfd[1].revents) {
+    char events[4096];
+    while (read(E->follow_fd, events, sizeof(events)) > 0)
+      ;
+    E->follow_pending = 1;
+  }
+  if (ready == 0 || !pfd[0].revents)
+    return 0;
+
+  ssize_t nread = read(STDIN_FILENO, &E->input[E->input_len],
+                       INPUT_BUFFER_SIZE - E->input_len);
+  if (nread == -1)
+    return errno == EAGAIN || errno == EINTR ? 0 : -1;
+  /* The terminal is gone if it polls readable but has nothing to read. */
+  if (nread == 0)
+    return -1;
+  E->input_len += nread;
+  /* The keys may have been typed after the file was truncated on disk. */
+  editor_check_file(E);
+  return nread;
+}
+
+int editor_input_pending(struct editor *E) {
+  return editor_wait_input(E, 0);
+}
+
+int editor_wait_input(struct editor *E, int timeout) {
+  return E->input_len > 0 || editor_fill_input(E, timeout) > 0;
+}
+
+/* Reads the next key into c, waiting up to timeout milliseconds, or
+ * indefinitely if timeout is negative. Returns 0 if no key arrived in time. */
+int editor_read_key_timeout(struct editor *E, char *c, int timeout) {
+  while (E->input_len == 0) {
+    int nread = editor_fill_input(E, timeout);
+    if (nread == -1)
+      exit(1);
+    if (nread == 0 && timeout >= 0)
+      return 0;
+  }
+
+  *c = E->input[E->input_start++];
+  E->input_len--;
+  return 1;
+}
+
+char editor_read_key(struct editor *E) {
+  char c;
+  editor_read_key_timeout(E, &c, -1);
+  return c;
+}
+
+/* Consumes the provided sequence and returns 1 if the pending input starts with
+ * it. Waits briefly for the rest of a sequence that has only partly
+ * arrived. */
+int editor_match_input(struct editor *E, const char *seq) {
+  int len = strlen(seq);
+  while (E->input_len < len) {
+    if (E->input_len == 0 ||
+        memcmp(&E->input[E->input_start], seq, E->input_len) != 0)
+      return 0;
+    if (editor_fill_input(E, ESCAPE_TIMEOUT) <= 0)
+      return 0;
+  }
+  if (memcmp(&E->input[E->input_start], seq, len) != 0)
+    return 0;
+
+  E->input_start += len;
+  E->input_len -= len;
+  return 1;
+}
+
+/* Moves the cursor to the provided column of its line. In normal mode the
+ * cursor is displayed on the last cell of the character under it, which
+ * matters for tabs, and in insert mode on the first cell. */
+void editor_set_cursor_col(struct editor *E, size_t col) {
+  struct line *line = editor_line(E);
+  E->file_cursor_col = editor_clamp(col);
+  if (E->mode == MODE_INSERT || col >= line->len)
+    E->render_cursor_col = render_line_col(line, E->file_cursor_col, TAB_STOP);
+  else
+    E->render_cursor_col =
+        render_line_col(line, E->file_cursor_col + 1, TAB_STOP) - 1;
+}
+
+/* Moves the cursor to the character of its line displayed at the provided
+ * column, or the closest one to it. */
+void editor_set_cursor_render_col(struct editor *E, int render_col) {
+  editor_set_cursor_col(
+      E, render_line_file_col(editor_line(E), render_col, TAB_STOP));
+}
+
+/* Moves the cursor to the provided row, or the closest one in the file,
+ * keeping it in the same display column where possible. */
+void editor_set_cursor_row(struct editor *E, int row) {
+  if (row < 0)
+    row = 0;
+  else if ((size_t)row >= E->file->len)
+    row = editor_clamp(E->file->len - 1);
+  E->file_cursor_row = row;
+  editor_set_cursor_render_col(E, E->render_cursor_col);
+}
+
+/* Moves the cursor to the provided position. */
+void editor_move_cursor(struct editor *E, int row, int col) {
+  E->file_cursor_row = row;
+  editor_set_cursor_col(E, col);
+}
+
+/* Moves the cursor to the provided position, or the closest one in the file,
+ * after the rows changed under it. */
+void editor_clamp_cursor(struct editor *E, size_t row, size_t col) {
+  E->file_cursor_row = row < E->file->len ? row : E->file->len - 1;
+  size_t len = editor_line(E)->len;
+  editor_set_cursor_col(E, col < len ? col : len > 0 ? len - 1 : 0);
+}
+
+void editor_check_file(struct editor *E) {
+  if (!file_check(E->file))
+    return;
+
+  search_forget_all(&E->search);
+  search_forget_all(&E->search_typed);
+  editor_touch_screen(E);
+  editor_clamp_cursor(E, E->file_cursor_row, E->file_cursor_col);
+  E->truncated = 1;
+}
+
+/* Moves the cursor to the closest match of the search from the provided
+ * position. Tells the user and leaves the cursor alone if there is none. */
+void editor_search(struct editor *E, struct search *search, int forward,
+                   int row, int col) {
+  size_t match_row = row, match_col = col;
+  if (search_file(search, E->file, forward, &match_row, &match_col)) {
+    editor_move_cursor(E, match_row, match_col);
+  } else if (search->len > 0) {
+    char message[COMMAND_SIZE + 32];
+    snprintf(message, sizeof(message), "Pattern not found: %s",
+             search->pattern);
+    editor_set_message(E, message);
+  }
+}
+
+/* Moves the cursor to the first match of the pattern typed so far, or back to
+ * where it was when search mode was entered. */
+void editor_search_preview(struct editor *E) {
+  search_set(&E->search_typed, E->command, E->command_len);
+  editor_move_cursor(E, E->search_row, E->search_col);
+  size_t row = E->search_row, col = E->search_col;
+  if (search_file(&E->search_typed, E->file, E->search_forward, &row, &col))
+    editor_move_cursor(E, row, col);
+  editor_touch_screen(E);
+}
+
+/* Leaves search mode, moving to the first match of the typed pattern and
+ * making it the last search if enter was pressed. An empty pattern repeats
+ * the last search. */
+void editor_end_search(struct editor *E, int enter) {
+  E->mode = MODE_NORMAL;
+  editor_move_cursor(E, E->search_row, E->search_col);
+  editor_touch_screen(E);
+  if (!enter)
+    return;
+
+  if (E->command_len > 0) {
+    struct search last = E->search;
+    E->search = E->search_typed;
+    E->search_typed = last;
+  }
+  if (E->search.len == 0) {
+    editor_set_message(E, "No previous search");
+    return;
+  }
+  E->search_highlight = 1;
+  editor_search(E, &E->search, E->search_forward, E->search_row,
+                E->search_col);
+}
+
+/* Inserts text at the cursor. The text is split into lines once and all the
+ * new rows are added to the file in a single insertion. Returns 0 without
+ * changing the file if a line could get longer than LINE_LEN_MAX. */
+int editor_paste(struct editor *E, const char *text, size_t len) {
+  const char *end = text + len;
+  size_t breaks = 0, longest = 0;
+  for (const char *p = text;; breaks++) {
+    const char *eol = split_find_eol(p, end);
+    if ((size_t)(eol - p) > longest)
+      longest = eol - p;
+    if (eol == end)
+      break;
+    p = eol + (*eol == '\r' && eol + 1 < end && eol[1] == '\n' ? 2 : 1);
+  }
+
+  /* Pieces of text are checked as if they joined the whole cursor line. */
+  struct line *line = editor_line(E);
+  if (longest > LINE_LEN_MAX - line->len)
+    return 0;
+
+  editor_change(E);
+  int row = E->file_cursor_row;
+  swap_write(E->swap, SWAP_PASTE, row, E->file_cursor_col, 0, text, len);
+
+  /* The cursor line is kept as it was to undo the paste, which copies it
+   * unless it is not owned by the line. */
+  struct line *held = malloc(sizeof(struct line));
+  *held = (struct line){line->chars, line->len, line->cap, NULL};
+  if (line->cap > 0)
+    *held = file_new_line(E->file, line->chars, line->len);
+
+  size_t tail_len = line->len - E->file_cursor_col;
+  char *tail = edit_split_string(line, E->file_cursor_col);
+  struct line *lines = malloc(sizeof(struct line) * (breaks + 1));
+
+  /* The first piece of text joins the start of the cursor line and the last
+   * piece goes in front of its end. */
+  const char *p = text;
+  size_t last_len = 0;
+  for (size_t i = 0; i <= breaks; i++) {
+    const char *eol = split_find_eol(p, end);
+
+    last_len = eol - p;
+    if (i == 0) {
+      last_len += E->file_cursor_col;
+      edit_append_string(line, p, eol - p);
+    } else {
+      lines[i - 1] = file_new_line(E->file, p, eol - p);
+    }
+
+    if (eol < end)
+      p = eol + (*eol == '\r' && eol + 1 < end && eol[1] == '\n' ? 2 : 1);
+  }
+
+  edit_append_string(breaks == 0 ? line : &lines[breaks - 1], tail, tail_len);
+  free(tail);
+  file_insert_rows(E->file, row + 1, lines, breaks);
+  free(lines);
+  undo_rows(&E->undo, row, held, 1, breaks + 1);
+
+  editor_touch_rows(E, row, row + 1);
+  editor_shift_rows(E, row + 1, breaks);
+  E->file_cursor_row = row + breaks;
+  if (E->mode == MODE_NORMAL && last_len > 0 &&
+      last_len == editor_line(E)->len)
+    last_len--;
+  editor_set_cursor_col(E, last_len);
+  return 1;
+}
+
+/* Reads pasted text up to the end of the paste and inserts it at the
+ * cursor, or in command and search modes adds it to the command line. */
+void editor_read_paste(struct editor *E) {
+  size_t len = 0, cap = INPUT_BUFFER_SIZE;
+  char *text = malloc(cap);
+
+  while (1) {
+    if (E->input_len == 0 && editor_fill_input(E, -1) == -1)
+      exit(1);
+
+    /* Copy everything up to the next escape, which may end the paste. */
+    char *start = &E->input[E->input_start];
+    char *esc = memchr(start, '\033', E->input_len);
+    size_t n = esc ? esc - start : E->input_len;
+    if (len + n + 1 > cap) {
+      while (len + n + 1 > cap)
+        cap *= 2;
+      text = realloc(text, cap);
+    }
+    memcpy(&text[len], start, n);
+    len += n;
+    E->input_start += n;
+    E->input_len -= n;
+
+    if (esc) {
+      E->input_start++;
+      E->input_len--;
+      if (editor_match_input(E, RENDER_PASTE_END))
+        break;
+      text[len++] = '\033';
+    }
+  }
+
+  if (E->mode == MODE_COMMAND || E->mode == MODE_SEARCH) {
+    /* Only the characters that could be typed go in the command line. */
+    for (size_t i = 0; i < len && E->command_len < COMMAND_SIZE - 1; i++)
+      if (isprint((unsigned char)text[i]))
+        E->command[E->command_len++] = text[i];
+    if (E->mode == MODE_SEARCH)
+      editor_search_preview(E);
+  } else if (editor_writable(E)) {
+    /* A paste in insert mode is part of the insertion. */
+    if (E->mode == MODE_NORMAL)
+      editor_start_step(E, E->file_cursor_row, E->file_cursor_col);
+    if (!editor_paste(E, text, len))
+      editor_set_message(E, "Line too long");
+  }
+  free(text);
+}
+
+/* Replaces the matches of the last search in the rows from up to, but not
+ * including, to with len characters of with: every match of a row if all is
+ * set and otherwise the first one. Stores the number of matches replaced in
+ * *count and returns the number of rows changed. */
+size_t editor_replace(struct editor *E, const char *with, size_t len,
+                      size_t from, size_t to, int all, size_t *count) {
+  size_t *old_rows = NULL;
+  struct line *old = NULL;
+  size_t rows = replace_rows(E->file, &E->search, with, len, from, to, all,
+                             count, &old, &old_rows);
+  if (rows == 0) {
+    free(old);
+    free(old_rows);
+    return 0;
+  }
+
+  editor_start_step(E, E->file_cursor_row, E->file_cursor_col);
+  editor_change(E);
+  undo_set_rows(&E->undo, old_rows, old, rows);
+  if (E->swap) {
+    /* The record holds the pattern followed by the replacement. */
+    char *text = malloc(E->search.len + len + 1);
+    memcpy(text, E->search.pattern, E->search.len);
+    memcpy(text + E->search.len, with, len);
+    swap_write(E->swap, SWAP_SUBSTITUTE, from, to, E->search.len * 2 + all,
+               text, E->search.len + len);
+    free(text);
+  }
+  editor_touch_rows(E, from, to);
+  return rows;
+}
+
+/* Reads a part of a substitute command up to the delimiter, removing the
+ * backslashes that escape it. Stores the length of the part in *len and
+ * returns the position after the delimiter, or at the end of the command. */
+char *editor_parse_part(char *p, char delim, size_t *len) {
+  char *out = p;
+  *len = 0;
+  for (; *p != '\0' && *p != delim; p++) {
+    if (*p == '\\' && p[1] == delim)
+      p++;
+    out[(*len)++] = *p;
+  }
+  return *p == delim ? p + 1 : p;
+}
+
+/* Runs a command of the form s/pattern/replacement/g on the cursor row, or on
+ * every row if it starts with %. The g flag replaces every match of a row
+ * instead of the first one, and an empty pattern uses the last search. */
+void editor_substitute(struct editor *E, char *command) {
+  int whole = command[0] == '%';
+  char *p = command + (whole ? 2 : 1);
+  char delim = *p++;
+
+  size_t pattern_len, with_len;
+  char *pattern = p;
+  p = editor_parse_part(p, delim, &pattern_len);
+  char *with = p;
+  p = editor_parse_part(p, delim, &with_len);
+
+  int all = 0;
+  for (; *p == 'g'; p++)
+    all = 1;
+  if (*p != '\0') {
+    char message[COMMAND_SIZE + 32];
+    snprintf(message, sizeof(message), "Trailing characters: %s", p);
+    editor_set_message(E, message);
+    return;
+  }
+
+  if (pattern_len > 0) {
+    search_set(&E->search, pattern, pattern_len);
+    editor_touch_screen(E);
+  } else if (E->search.len == 0) {
+    editor_set_message(E, "No previous search");
+    return;
+  }
+  if (!editor_writable(E))
+    return;
+
+  /* Rows still being read are substituted too. */
+  if (whole && E->load_percent < 100) {
+    file_load_wait(E->file);
+    editor_load(E);
+  }
+
+  size_t from = whole ? 0 : E->file_cursor_row;
+  size_t to = whole ? E->file->len : from + 1;
+  size_t count;
+  size_t rows = editor_replace(E, with, with_len, from, to, all, &count);
+
+  char message[COMMAND_SIZE + 64];
+  if (rows == 0) {
+    snprintf(message, sizeof(message), "Pattern not found: %s",
+             E->search.pattern);
+  } else {
+    editor_set_cursor_render_col(E, E->render_cursor_col);
+    snprintf(message, sizeof(message), "%zu substitution%s on %zu line%s",
+             count, count == 1 ? "" : "s", rows, rows == 1 ? "" : "s");
+  }
+  editor_set_message(E, message);
+}
+
+/* Replaces rows as journaled by a SWAP_ROWS record, without recording it to
+ * undo since the step it belongs to was not recovered. Returns 0 if the
+ * record does not apply. */
+static int editor_replay_rows(struct editor *E, struct swap_record *r) {
+  size_t len = E->file->len;
+  if (r->a > len || r->c > len - r->a || len - r->c + r->b == 0)
+    return 0;
+
+  struct line *lines = malloc(sizeof(struct line) * (r->b > 0 ? r->b : 1));
+  const char *p = r->text, *end = r->text + r->len, *eol;
+  size_t n = 0;
+  while (n < r->b && (eol = memchr(p, '\n', end - p)) != NULL &&
+         eol - p <= LINE_LEN_MAX) {
+    lines[n++] = file_new_line(E->file, p, eol - p);
+    p = eol + 1;
+  }
+  if (n < r->b || p < end) {
+    for (size_t i = 0; i < n; i++)
+      file_line_free(&lines[i]);
+    free(lines);
+    return 0;
+  }
+
+  file_insert_rows(E->file, r->a, lines, n);
+  free(lines);
+  file_delete_rows(E->file, r->a + n, r->c);
+  editor_touch_rows(E, r->a, r->a + n);
+  if (n != r->c)
+    editor_shift_rows(E, r->a + n, (int)n - (int)r->c);
+  return 1;
+}
+
+/* Makes the change of a record read from the swap file again, through the
+ * function that made it. Returns 0 if the change does not apply to the file,
+ * which means the swap file was written for another version of it. */
+int editor_replay(struct editor *E, struct swap_record *r) {
+  size_t len = E->file->len;
+  if (r->op != SWAP_UNDO && r->op != SWAP_REDO && r->op != SWAP_SAVE &&
+      r->op != SWAP_REGISTER && r->op != SWAP_ROWS && r->a >= len)
+    return 0;
+  size_t line_len = r->a < len ? file_line(E->file, r->a)->len : 0;
+
+  switch (r->op) {
+  case SWAP_STEP:
+  case SWAP_PASTE:
+    /* Steps and pastes start at the cursor, which the changes after them
+     * may depend on. */
+    if (r->b > line_len)
+      return 0;
+    E->file_cursor_row = r->a;
+    E->file_cursor_col = r->b;
+    if (r->op == SWAP_STEP) {
+      /* Steps keep the ids they were journaled with. */
+      if (r->c > 0)
+        E->steps = r->c - 1;
+      editor_start_step(E, r->a, r->b);
+      return 1;
+    }
+    return editor_paste(E, r->text, r->len);
+  case SWAP_INSERT_TEXT:
+  case SWAP_SPLIT:
+    if (r->b > line_len)
+      return 0;
+    if (r->op == SWAP_INSERT_TEXT)
+      return editor_insert_text(E, r->a, r->b, r->text, r->len);
+    editor_split_row(E, r->a, r->b);
+    return 1;
+  case SWAP_DELETE_TEXT:
+    if (r->b > line_len || r->c > line_len - r->b)
+      return 0;
+    editor_delete_text(E, r->a, r->b, r->c);
+    return 1;
+  case SWAP_JOIN:
+    if (r->a + 1 >= len)
+      return 0;
+    return editor_join_row(E, r->a);
+  case SWAP_DELETE_ROWS:
+    if (r->c == 0 || r->c > len - r->a)
+      return 0;
+    editor_delete_rows(E, r->a, r->c);
+    return 1;
+  case SWAP_SUBSTITUTE: {
+    size_t pattern_len = r->c / 2, count;
+    if (r->b <= r->a || r->b > len || pattern_len == 0 ||
+        pattern_len > r->len)
+      return 0;
+    search_set(&E->search, r->text, pattern_len);
+    editor_replace(E, r->text + pattern_len, r->len - pattern_len, r->a, r->b,
+                   r->c & 1, &count);
+    return 1;
+  }
+  case SWAP_UNDO:
+  case SWAP_REDO: {
+    /* A step that was not recovered was made before the save recovery
+     * started from, and the rows it changed follow instead. */
+    size_t row, col;
+    int redo = r->op == SWAP_REDO;
+    E->replay_rows = r->a > 0 && undo_next(&E->undo, redo) != r->a;
+    if (E->replay_rows)
+      return 1;
+    if (redo)
+      return undo_redo(&E->undo, E->file, &row, &col, NULL, NULL);
+    return undo_undo(&E->undo, E->file, &row, &col, NULL, NULL);
+  }
+  case SWAP_ROWS:
+    return !E->replay_rows || editor_replay_rows(E, r);
+  case SWAP_SAVE:
+    return 1;
+  case SWAP_YANK:
+    if (r->c == 0 || r->c > len - r->a)
+      return 0;
+    editor_yank_rows(E, r->a, r->c);
+    return 1;
+  case SWAP_PUT:
+    if (r->b > 1 || r->c == 0 || r->c > COUNT_MAX)
+      return 0;
+    return editor_put(E, r->a, r->b, r->c);
+  case SWAP_REGISTER:
+    /* Lines come in order. */
+    if ((r->a > 0 && r->a != E->register_len) || r->len > LINE_LEN_MAX)
+      return 0;
+    if (r->a == 0)
+      editor_set_register(E, NULL, 0);
+    E->register_lines = realloc(E->register_lines,
+                                sizeof(struct line) * (r->a + 1));
+    E->register_lines[r->a] = file_new_line(E->file, r->text, r->len);
+    E->register_len = r->a + 1;
+    return 1;
+  }
+  return 0;
+}
+
+/* Replays the changes journaled in the swap file and keeps appending to it.
+ * If some of them do not apply, the swap file is left as it is. */
+void editor_recover(struct editor *E) {
+  char *path = swap_path(E->filename);
+  char message[MESSAGE_SIZE];
+  struct swap_journal j;
+  int result = swap_read(E->filename, &j);
+  if (result == -1) {
+    E->swap = swap_create(E->filename);
+    snprintf(message, sizeof(message), "No swap file found for %s",
+             E->filename);
+  } else if (result == -2) {
+    snprintf(message, sizeof(message), "Swap file %s does not match %s", path,
+             E->filename);
+  } else {
+    file_load_wait(E->file);
+    editor_load(E);
+
+    size_t end = j.pos, changes = 0;
+    struct swap_record r;
+    int applies = 1;
+    while (swap_next(&j, &r) && (applies = editor_replay(E, &r))) {
+      end = j.pos;
+      changes += r.op != SWAP_STEP && r.op != SWAP_SAVE &&
+                 r.op != SWAP_YANK && r.op != SWAP_REGISTER &&
+                 r.op != SWAP_ROWS;
+    }
+
+    search_forget_all(&E->search);
+    search_forget_all(&E->search_typed);
+    editor_touch_screen(E);
+    editor_clamp_cursor(E, E->file_cursor_row, E->file_cursor_col);
+
+    /* A record cut short by the crash is dropped from the swap file. */
+    if (applies)
+      E->swap = swap_open(E->filename, end);
+    snprintf(message, sizeof(message), "Recovered %zu change%s from %s%s",
+             changes, changes == 1 ? "" : "s", path,
+             applies ? "" : ", the rest does not apply");
+    swap_journal_free(&j);
+  }
+  editor_set_message(E, message);
+  free(path);
+}
+
+void editor_open_swap(struct editor *E, int recover) {
+  /* Large and followed files are read-only, so there is nothing to
+   * journal. */
+  if (E->file->index || E->follow)
+    return;
+
+  if (recover) {
+    editor_recover(E);
+    return;
+  }
+
+  E->swap = swap_create(E->filename);
+  if (!E->swap && errno == EEXIST) {
+    char *path = swap_path(E->filename);
+    char message[MESSAGE_SIZE];
+    snprintf(message, sizeof(message),
+             "Swap file %s exists, run vip -r %s to recover it", path,
+             E->filename);
+    editor_set_message(E, message);
+    free(path);
+  }
+}
+
+void editor_follow_start(struct editor *E) {
+  if (E->file->index) {
+    editor_set_message(E, "Large files cannot be followed");
+    return;
+  }
+
+  /* dirname may modify its argument. */
+  char *dir = strdup(E->filename);
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  int watch = -1;
+  if (fd != -1 &&
+      (watch = inotify_add_watch(fd, E->filename, FOLLOW_FILE_EVENTS)) != -1 &&
+      inotify_add_watch(fd, dirname(dir), FOLLOW_DIR_EVENTS) != -1) {
+    E->follow = 1;
+    E->follow_fd = fd;
+    E->follow_watch = watch;
+  } else {
+    char message[MESSAGE_SIZE];
+    snprintf(message, sizeof(message), "Cannot follow %s: %s", E->filename,
+             strerror(errno));
+    editor_set_message(E, message);
+    if (fd != -1)
+      close(fd);
+  }
+  free(dir);
+}
+
+void editor_follow(struct editor *E) {
+  E->follow_pending = 0;
+  size_t len = E->file->len;
+  int at_end = (size_t)E->file_cursor_row + 1 == len;
+
+  enum file_follow result = file_follow(E->file, E->filename);
+  if (result == FILE_FOLLOW_SAME)
+    return;
+
+  if (result == FILE_FOLLOW_GREW) {
+    /* The last row may have been continued. */
+    editor_touch_rows(E, len - 1, E->file->len);
+  } else {
+    struct file *f = file_open(E->filename);
+    if (!f)
+      return;
+    file_close(E->file);
+    E->file = f;
+    file_load_wait(f);
+    E->load_percent = file_load(f);
+
+    /* The file that was replaced is no longer watched. */
+    inotify_rm_watch(E->follow_fd, E->follow_watch);
+    E->follow_watch =
+        inotify_add_watch(E->follow_fd, E->filename, FOLLOW_FILE_EVENTS);
+
+    search_forget_all(&E->search);
+    search_forget_all(&E->search_typed);
+    editor_touch_screen(E);
+    editor_clamp_cursor(E, E->file_cursor_row, E->file_cursor_col);
+
+    char message[MESSAGE_SIZE];
+    snprintf(message, sizeof(message), "%s was truncated or replaced",
+             E->filename);
+    editor_set_message(E, message);
+  }
+
+  if (at_end)
+    editor_set_cursor_row(E, E->file->len - 1);
+}
+
+/* Runs the command typed in command mode. Returns 0 when the editor should
+ * quit. */
+int editor_run_command(struct editor *E) {
+  char *command = E->command;
+  command[E->command_len] = '\0';
+  E->mode = MODE_NORMAL;
+
+  if (strcmp(command, "w") == 0) {
+    if (editor_writable(E))
+      editor_save_file(E, E->filename);
+  } else if (strcmp(command, "q") == 0) {
+    return 0;
+  } else if (strcmp(command, "wq") == 0) {
+    /* The editor stays open if the save fails, keeping the swap file. */
+    if (!editor_writable(E))
+      return 1;
+    return editor_save_file(E, E->filename) == -1 ||
+           editor_check_save(E, 1) == -1;
+  } else if (strcmp(command, "noh") == 0 ||
+             strcmp(command, "nohlsearch") == 0) {
+    E->search_highlight = 0;
+    editor_touch_screen(E);
+  } else if (strcmp(command, "stats") == 0) {
+    char report[MESSAGE_SIZE];
+    stats_report(report, sizeof(report));
+    editor_set_message(E, report);
+  } else if ((command[0] == 's' || strncmp(command, "%s", 2) == 0) &&
+             ispunct((unsigned char)command[command[0] == '%' ? 2 : 1])) {
+    editor_substitute(E, command);
+  } else if (E->command_len > 0) {
+    char message[COMMAND_SIZE + 32];
+    snprintf(message, sizeof(message), "Not an editor command: %s", command);
+    editor_set_message(E, message);
+  }
+  return 1;
+}
+
+/* Handles the key that was just read. Returns 0 when the editor should
+ * quit. */
+int editor_process_key(struct editor *E, char c) {
+  if (E->message_rows > 0)
+    editor_clear_message(E);
+  if (E->truncated) {
+    char message[MESSAGE_SIZE];
+    snprintf(message, sizeof(message),
+             "%s was truncated on disk, the text past its new end is lost",
+             E->filename);
+    editor_set_message(E, message);
+    E->truncated = 0;
+  }
+  editor_check_save(E, 0);
+  if (E->load_percent < 100)
+    editor_load(E);
+
+  if (c == '\033' && editor_match_input(E, RENDER_PASTE_START)) {
+    editor_read_paste(E);
+    return 1;
+  }
+
+  switch (E->mode) {
+  case MODE_NORMAL:
+    switch (c) {
+    case '\033':
+      if (!editor_read_key_timeout(E, &c, ESCAPE_TIMEOUT))
+        break;
+      if (!editor_read_key_timeout(E, &c, ESCAPE_TIMEOUT))
+        break;
+      switch (c) {
+      case 'A':
+        c = 'k';
+        break;
+      case 'B':
+        c = 'j';
+        break;
+      }
+      break;
+    }
+
+    /* Digits make up a count for the next command, which is run once as a
+     * whole instead of count times. A leading 0 is not part of a count. */
+    if (isdigit((unsigned char)c) && (c != '0' || E->count > 0)) {
+      if (E->count <= (COUNT_MAX - (c - '0')) / 10)
+        E->count = E->count * 10 + (c - '0');
+      break;
+    }
+    int typed = E->count;
+    int count = typed > 0 ? typed : 1;
+    E->count = 0;
+
+    /* Keys that would change the file do nothing in read-only files. */
+    if (c != '\0' && (strchr("aiAxdupP", c) || c == CTRL_KEY('r')) &&
+        !editor_writable(E))
+      break;
+
+    /* Every command that changes the file is undone as a whole, and so is
+     * everything typed in insert mode. The step is only recorded once the
+     * command makes a change, which d followed by another key or x on an
+     * empty row never do. */
+    if (c != '\0' && strchr("aiAxdpP", c))
+      editor_start_step(E, E->file_cursor_row, E->file_cursor_col);
+
+    switch (c) {
+    case 'k':
+      editor_set_cursor_row(E, E->file_cursor_row - count);
+      break;
+    case 'j':
+      editor_set_cursor_row(E, E->file_cursor_row + count);
+      break;
+    case CTRL_KEY('f'):
+    case CTRL_KEY('b'): {
+      /* Pages overlap by two rows. The cursor stays where it is if it is
+       * still on the screen, and moves to the end of the file if the view is
+       * already there. */
+      int page = E->screen_lines > 2 ? E->screen_lines - 2 : 1;
+      size_t pages = E->file->len / page + 1;
+      if (pages < (size_t)count)
+        count = pages;
+      int forward = c == CTRL_KEY('f');
+      int row = E->file_cursor_row, n = editor_clamp((size_t)page * count);
+      if (editor_scroll_view(E, forward ? n : -n) == 0)
+        row = forward ? editor_clamp(E->file->len - 1) : 0;
+      else if (forward && row < E->render_row_offset)
+        row = E->render_row_offset;
+      else if (!forward && row >= E->render_row_offset + E->screen_lines)
+        row = E->render_row_offset + E->screen_lines - 1;
+      editor_set_cursor_row(E, row);
+      break;
+    }
+    case CTRL_KEY('d'):
+    case CTRL_KEY('u'): {
+      /* The view and the cursor move by half a screen together. */
+      int half = E->screen_lines > 1 ? E->screen_lines / 2 : 1;
+      int n = c == CTRL_KEY('d') ? half : -half;
+      editor_scroll_view(E, n);
+      editor_set_cursor_row(E, E->file_cursor_row + n);
+      break;
+    }
+    case 'G':
+      editor_set_cursor_row(E, typed > 0 ? typed - 1
+                                         : editor_clamp(E->file->len - 1));
+      break;
+    case 'g':
+      if (editor_read_key(E) == 'g')
+        editor_set_cursor_row(E, typed > 0 ? typed - 1 : 0);
+      break;
+    case 'l': {
+      size_t len = editor_line(E)->len, col = E->file_cursor_col;
+      if (col + 1 < len)
+        editor_set_cursor_col(
+            E, len - 1 - col > (size_t)count ? col + count : len - 1);
+      break;
+    }
+    case 'h':
+      if (E->file_cursor_col > 0)
+        editor_set_cursor_col(E, E->file_cursor_col > count
+                                     ? E->file_cursor_col - count
+                                     : 0);
+      break;
+    case 'a':
+      E->mode = MODE_INSERT;
+      if (editor_line(E)->len > 0)
+        editor_set_cursor_col(E, E->file_cursor_col + 1);
+      else
+        editor_set_cursor_col(E, E->file_cursor_col);
+      break;
+    case 'i':
+      E->mode = MODE_INSERT;
+      editor_set_cursor_col(E, E->file_cursor_col);
+      break;
+    case 'A':
+      E->mode = MODE_INSERT;
+      editor_set_cursor_col(E, editor_line(E)->len);
+      break;
+    case 'x': {
+      size_t col = E->file_cursor_col, len = editor_line(E)->len - col;
+      if (editor_line(E)->len > 0) {
+        editor_delete_text(E, E->file_cursor_row, col,
+                           len < (size_t)count ? len : (size_t)count);
+
+        if (col >= editor_line(E)->len && col > 0)
+          editor_set_cursor_col(E, col - 1);
+        else
+          editor_set_cursor_col(E, col);
+      }
+      break;
+    }
+    case 'd': {
+      c = editor_read_key(E);
+      if (c == 'd') {
+        size_t len = E->file->len - E->file_cursor_row;
+        if (len > (size_t)count)
+          len = count;
+        editor_delete_rows(E, E->file_cursor_row, len);
+        if (E->file_cursor_row > 0)
+          E->file_cursor_row--;
+        editor_set_cursor_render_col(E, E->render_cursor_col);
+      }
+      break;
+    }
+    case 'y': {
+      /* Nothing can be put in read-only files, whose lines may also not
+       * outlive the file or the block they were read into. */
+      if (editor_read_key(E) != 'y' || E->file->index || E->follow)
+        break;
+      size_t len = E->file->len - E->file_cursor_row;
+      editor_yank_rows(E, E->file_cursor_row,
+                       len < (size_t)count ? len : (size_t)count);
+      break;
+    }
+    case 'p':
+    case 'P': {
+      if (E->register_len == 0) {
+        editor_set_message(E, "Nothing to put");
+        break;
+      }
+      if (!editor_put(E, E->file_cursor_row, c == 'P', count)) {
+        editor_set_message(E, "Too many lines to put");
+        break;
+      }
+      if (c == 'p')
+        E->file_cursor_row++;
+
+      /* The cursor goes to the first character that is not a blank. */
+      struct line *line = editor_line(E);
+      size_t col = 0;
+      while (col < line->len &&
+             (line->chars[col] == ' ' || line->chars[col] == '\t'))
+        col++;
+      editor_set_cursor_col(E, col < line->len ? col : 0);
+      break;
+    }
+    case 'u':
+    case CTRL_KEY('r'): {
+      size_t row, col;
+      int steps = 0;
+      while (steps < count && editor_undo(E, c != 'u', &row, &col))
+        steps++;
+      if (steps == 0) {
+        editor_set_message(E, c == 'u' ? "Already at oldest change"
+                                       : "Already at newest change");
+        break;
+      }
+
+      search_forget_all(&E->search);
+      search_forget_all(&E->search_typed);
+      editor_touch_screen(E);
+      editor_clamp_cursor(E, row, col);
+      break;
+    }
+    case ':':
+      E->mode = MODE_COMMAND;
+      E->command_len = 0;
+      break;
+    case '/':
+    case '?':
+      E->mode = MODE_SEARCH;
+      E->command_len = 0;
+      E->search_forward = c == '/';
+      E->search_row = E->file_cursor_row;
+      E->search_col = E->file_cursor_col;
+      search_set(&E->search_typed, "", 0);
+      editor_touch_screen(E);
+      break;
+    case 'n':
+    case 'N': {
+      if (E->search.len == 0) {
+        editor_set_message(E, "No previous search");
+        break;
+      }
+      if (!E->search_highlight) {
+        E->search_highlight = 1;
+        editor_touch_screen(E);
+      }
+      int forward = c == 'n' ? E->search_forward : !E->search_forward;
+      for (int i = 0; i < count && E->message_rows == 0; i++)
+        editor_search(E, &E->search, forward, E->file_cursor_row,
+                      E->file_cursor_col);
+      break;
+    }
+    }
+    break;
+  case MODE_INSERT:
+    switch (c) {
+    case '\033':
+      E->mode = MODE_NORMAL;
+      if (E->file_cursor_col > 0 &&
+          (size_t)E->file_cursor_col == editor_line(E)->len)
+        editor_set_cursor_col(E, E->file_cursor_col - 1);
+      else
+        editor_set_cursor_col(E, E->file_cursor_col);
+      break;
+    case 127: {
+      if (E->file_cursor_col > 0) {
+        editor_delete_text(E, E->file_cursor_row, E->file_cursor_col - 1, 1);
+        editor_set_cursor_col(E, E->file_cursor_col - 1);
+      } else {
+        if (E->file_cursor_row > 0) {
+          int join_col = file_line(E->file, E->file_cursor_row - 1)->len;
+
+          // Append the current line to the previous line
+          if (editor_join_row(E, E->file_cursor_row - 1)) {
+            // Move the cursor to the join position
+            E->file_cursor_row--;
+            editor_set_cursor_col(E, join_col);
+          } else {
+            editor_set_message(E, "Line too long");
+          }
+        }
+      }
+      break;
+    }
+    case '\r': {
+      editor_split_row(E, E->file_cursor_row, E->file_cursor_col);
+      E->file_cursor_row++;
+      editor_set_cursor_col(E, 0);
+      break;
+    }
+    default:
+      if (editor_insert_text(E, E->file_cursor_row, E->file_cursor_col, &c, 1))
+        editor_set_cursor_col(E, E->file_cursor_col + 1);
+      else
+        editor_set_message(E, "Line too long");
+      break;
+    }
+    break;
+  case MODE_COMMAND:
+    switch (c) {
+    case '\033':
+      E->mode = MODE_NORMAL;
+      break;
+    case '\r':
+      return editor_run_command(E);
+    case 127:
+      if (E->command_len == 0)
+        E->mode = MODE_NORMAL;
+      else
+        E->command_len--;
+      break;
+    default:
+      if (isprint((unsigned char)c) && E->command_len < COMMAND_SIZE - 1)
+        E->command[E->command_len++] = c;
+      break;
+    }
+    break;
+  case MODE_SEARCH:
+    switch (c) {
+    case '\033':
+      editor_end_search(E, 0);
+      break;
+    case '\r':
+      editor_end_search(E, 1);
+      break;
+    case 127:
+      if (E->command_len == 0) {
+        editor_end_search(E, 0);
+      } else {
+        E->command_len--;
+        editor_search_preview(E);
+      }
+      break;
+    default:
+      if (isprint((unsigned char)c) && E->command_len < COMMAND_SIZE - 1) {
+        E->command[E->command_len++] = c;
+        editor_search_preview(E);
+      }
+      break;
+    }
+    break;
+  }
+
+  return 1;
+}
+
+int editor_process_input(struct editor *E) {
+  char c = editor_read_key(E);
+  STATS_START(start);
+  int result = editor_process_key(E, c);
+  STATS_STOP(key_ns, start);
+  return result;
+}
+
@@ -0,0 +1,218 @@
+#ifndef _EDITOR_H_
+#define _EDITOR_H_
+
+#include "file.h"
+#include "render.h"
+#include "search.h"
+#include "swap.h"
+#include "undo.h"
+#include <time.h>
+
+/* Editor configuration. */
+#define TAB_STOP 4
+
+/* Time to wait for the rest of an escape sequence before treating the escape
+ * key as pressed on its own, in milliseconds. */
+#define ESCAPE_TIMEOUT 100
+
+/* Number of keys that can be read ahead of processing. */
+#define INPUT_BUFFER_SIZE 4096
+
+/* Write files on a background thread so that editing can continue while large
+ * files are saved. */
+#define SAVE_IN_BACKGROUND 1
+
+/* Largest count that can be typed before a command in normal mode. */
+#define COUNT_MAX 99999999
+
+/* Maximum length of a command typed in command mode. */
+#define COMMAND_SIZE 256
+
+/* Maximum length of a message shown at the bottom of the screen. */
+#define MESSAGE_SIZE 2048
+
+/* Time between frames showing the lines of a file still being read, in
+ * milliseconds. */
+#define LOAD_REFRESH 50
+
+/* Time between checks for a save running in the background having finished,
+ * in milliseconds. */
+#define SAVE_REFRESH 50
+
+/* Environment variable naming a file to write the statistics to on exit. */
+#define STATS_DUMP_ENV "VIP_STATS"
+
+enum editor_mode {
+  MODE_NORMAL,
+  MODE_INSERT,
+  MODE_COMMAND,
+  MODE_SEARCH,
+};
+
+struct editor {
+  char *filename;
+  struct file *file;
+
+  /* Percentage of the file read so far. */
+  int load_percent;
+
+  struct render_buffer render_buffer;
+  struct render_screen screen;
+
+  enum editor_mode mode;
+
+  /* Count typed before a command in normal mode, 0 when none was typed. */
+  int count;
+
+  /* Number of lines and columns on the screen used for the file. The row
+   * below the last line is the command line. */
+  int screen_lines;
+  int screen_cols;
+
+  /* Actual position of the cursor in the file. */
+  int file_cursor_row;
+  int file_cursor_col;
+
+  /* Required for tabs. The column where the cursor renders is not the same as
+   * the column where the cursor is in the file. */
+  int render_cursor_col;
+
+  /* Offsets for scrolling. */
+  int render_row_offset;
+  int render_col_offset;
+
+  /* Keys read from the terminal but not processed yet. */
+  char input[INPUT_BUFFER_SIZE];
+  int input_start;
+  int input_len;
+
+  /* Command being typed in command mode, or pattern in search mode. */
+  char command[COMMAND_SIZE];
+  int command_len;
+
+  /* Message shown until the next key. It covers the command line and, if it
+   * has several lines, the rows above it. */
+  char message[MESSAGE_SIZE];
+  int message_rows;
+
+  /* Pattern of the last search, repeated with n and N, and whether its
+   * matches are highlighted. */
+  struct search search;
+  int search_highlight;
+
+  /* Pattern being typed in search mode. Its first match is shown as it is
+   * typed, and it replaces the last search once it is entered. */
+  struct search search_typed;
+
+  /* Direction of the last search, and the cursor position when search mode
+   * was entered. */
+  int search_forward;
+  int search_row;
+  int search_col;
+
+  /* Changes made to the file, to undo and redo them. A command that may change
+   * the file starts a step, which is only recorded once it makes its first
+   * change, from the cursor position it started at. */
+  struct undo undo;
+  int step_pending;
+  int step_row;
+  int step_col;
+
+  /* Id of the last step, and of the last one made before a save of the file
+   * last started. Recovery starts from the save without the steps made before
+   * it, so undoing or redoing them is journaled with the rows it changes. While
+   * recovering, replay_rows is set when the rows journaled after the last
+   * undo or redo are to be changed, since its step was not recovered. */
+  size_t steps;
+  size_t steps_saved;
+  int replay_rows;
+
+  /* Lines last yanked or deleted, which p and P put back. They share their
+   * characters with the rows they came from and the rows they are put in, so
+   * whole ranges move without copying text. */
+  struct line *register_lines;
+  size_t register_len;
+
+  /* Swap file the changes are journaled to, or NULL if there is none. */
+  struct swap *swap;
+
+  /* Set while a save runs in the background, with the time it started at and
+   * the offset of the swap file then, which are journaled once it completes
+   * for recovery to start from there. */
+  int saving;
+  struct timespec save_time;
+  size_t save_offset;
+
+  /* Set when the file is followed as it grows. The inotify descriptor
+   * watches the file and its directory, the watch on the file is moved to the
+   * new one when it is replaced, and pending is set once they reported
+   * changes that were not read yet. */
+  int follow;
+  int follow_fd;
+  int follow_watch;
+  int follow_pending;
+
+  /* Set when the file was found truncated on disk, until the user is told. */
+  int truncated;
+};
+
+void editor_open_file(struct editor *E, char *filename);
+
+/* Sets up the screen for a terminal of the provided size. */
+void editor_init_screen(struct editor *E, int rows, int cols);
+
+/* Creates the swap file of the file, or with recover set replays the changes
+ * journaled in the existing one to bring back the edits of a session that
+ * crashed. Must be called after the screen is set up. */
+void editor_open_swap(struct editor *E, int recover);
+
+/* Follows the file: the lines appended to it are added as they are written,
+ * and it is opened again when it is truncated or replaced, such as by log
+ * rotation. The file is then read-only. */
+void editor_follow_start(struct editor *E);
+
+/* Reads what changed in the followed file since the last call. The view
+ * follows the new lines if the cursor is on the last row. */
+void editor_follow(struct editor *E);
+
+/* Checks whether another program truncated the file on disk, which loses the
+ * text of the unedited lines that were still read from the part it cut off.
+ * The user is told with the next key. Must be called before lines are read
+ * again after waiting, which reading keys does. */
+void editor_check_file(struct editor *E);
+
+/* Saves the file, on a background thread if SAVE_IN_BACKGROUND is set.
+ * Returns -1 if the save failed or could not be started, which the user is
+ * told. */
+int editor_save_file(struct editor *E, char *filename);
+
+/* Notes the end of the save running in the background, waiting for it if wait
+ * is set. Returns -1 if it failed, which the user is told. */
+int editor_check_save(struct editor *E, int wait);
+
+/* Frees the editor and clears the terminal. */
+void editor_close(struct editor *E);
+
+/* Draws the rows that changed since the last frame and appends the difference
+ * to the render buffer, without writing it out. */
+void editor_draw(struct editor *E);
+
+/* Draws the rows that changed since the last frame and writes the difference
+ * to the terminal. */
+void editor_refresh(struct editor *E);
+
+/* Adds the lines of the file read in the background since the last call. */
+void editor_load(struct editor *E);
+
+/* Returns 1 if there are keys waiting to be processed. */
+int editor_input_pending(struct editor *E);
+
+/* Waits up to timeout milliseconds for keys. Returns 1 if there are keys
+ * waiting to be processed. */
+int editor_wait_input(struct editor *E, int timeout);
+
+/* Reads and handles the next key, waiting for it if none is pending. Returns 0
+ * when the editor should quit. */
+int editor_process_input(struct editor *E);
+
+#endif /* _EDITOR_H_ */
@@ -1,58 +1,1555 @@
 #include "file.h"
+#include "edit.h"
+#include "split.h"
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
-struct file *file_open(const char *path) {
-  FILE *fp = fopen(path, "r");
-  if (!fp) {
-    return NULL;
+/* Maps the file at path into memory and stores its status in *st. Returns the
+ * descriptor it was mapped from, or -1 on failure, and leaves *map NULL for
+ * empty files, which cannot be mapped. */
+static int file_map(const char *path, char **map, size_t *map_len,
+                    struct stat *st) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return -1;
+
+  if (fstat(fd, st) == -1) {
+    close(fd);
+    return -1;
   }
 
-  struct file *f = malloc(sizeof(struct file));
-  *f = (struct file){NULL, 0};
+  *map = NULL;
+  *map_len = st->st_size;
+  if (*map_len > 0) {
+    void *addr = mmap(NULL, *map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    madvise(addr, *map_len, MADV_SEQUENTIAL);
+    *map = addr;
+  }
+  return fd;
+}
+
+/* Files of at least this many bytes are opened read-only with a sparse index
+ * instead of keeping every line in memory. It must not exceed LINE_LEN_MAX,
+ * so the lines of smaller files can all be held. */
+#ifndef FILE_LARGE_SIZE
+#define FILE_LARGE_SIZE ((off_t)1 << 30)
+#endif
+
+/* Maximum number of lines in a leaf and of children in a branch. */
+#define FILE_NODE_MAX 64
+
+struct file_node {
+  int leaf;
+  int count;
+};
+
+struct file_leaf {
+  struct file_node node;
+  struct line lines[FILE_NODE_MAX];
+};
+
+struct file_branch {
+  struct file_node node;
+  /* Number of lines below each child. */
+  size_t sizes[FILE_NODE_MAX];
+  struct file_node *children[FILE_NODE_MAX];
+};
+
+/* Size of the chunks that new short lines are packed into, and longest line
+ * packed. Longer lines get an allocation of their own, so deleting them gives
+ * the memory back. */
+#define FILE_CHUNK (1 << 16)
+#define FILE_CHUNK_LINE 256
+
+/* Number of chunks a file packs lines into. Chunks are only freed with the
+ * file, since lines pointing into them are copied by value to the undo
+ * history, the register and background saves, so the memory of deleted lines
+ * stays in use. Past this, new lines get allocations of their own instead. */
+#define FILE_CHUNKS_MAX 512
+
+struct file_chunk {
+  struct file_chunk *next;
+  size_t used;
+  char chars[FILE_CHUNK];
+};
+
+#define LEAF(n) ((struct file_leaf *)(n))
+#define BRANCH(n) ((struct file_branch *)(n))
+
+static struct file_node *node_new(int leaf) {
+  struct file_node *n =
+      malloc(leaf ? sizeof(struct file_leaf) : sizeof(struct file_branch));
+  n->leaf = leaf;
+  n->count = 0;
+  return n;
+}
+
+/* Frees the node, everything below it and the characters owned by its
+ * lines. */
+static void node_free(struct file_node *n) {
+  for (int i = 0; i < n->count; i++) {
+    if (n->leaf) {
+      file_line_free(&LEAF(n)->lines[i]);
+      file_line_changed(&LEAF(n)->lines[i]);
+    } else {
+      node_free(BRANCH(n)->children[i]);
+    }
+  }
+  free(n);
+}
 
-  char *line = NULL;
+/* Moves the lines below the node to out, in order, and frees the node and
+ * everything below it. Returns the number of lines moved. */
+static size_t node_take(struct file_node *n, struct line *out) {
   size_t len = 0;
-  ssize_t read;
+  for (int i = 0; i < n->count; i++) {
+    if (n->leaf) {
+      file_line_changed(&LEAF(n)->lines[i]);
+      out[len++] = LEAF(n)->lines[i];
+    } else {
+      len += node_take(BRANCH(n)->children[i], &out[len]);
+    }
+  }
+  free(n);
+  return len;
+}
+
+/* Returns the number of lines below the node. */
+static size_t node_size(struct file_node *n) {
+  if (n->leaf)
+    return n->count;
+
+  size_t size = 0;
+  for (int i = 0; i < n->count; i++)
+    size += BRANCH(n)->sizes[i];
+  return size;
+}
+
+/* Calls fn on every line below the node, in order. */
+static void node_walk(struct file_node *n, void (*fn)(struct line *, void *),
+                      void *arg) {
+  for (int i = 0; i < n->count; i++) {
+    if (n->leaf)
+      fn(&LEAF(n)->lines[i], arg);
+    else
+      node_walk(BRANCH(n)->children[i], fn, arg);
+  }
+}
+
+/* Groups the provided nodes into branches, level by level, and returns the
+ * root. The nodes array is reused for each level. */
+static struct file_node *node_build(struct file_node **nodes, size_t len) {
+  while (len > 1) {
+    size_t parents = 0;
+    for (size_t i = 0; i < len; i += FILE_NODE_MAX) {
+      struct file_node *parent = node_new(0);
+      for (size_t j = i; j < len && j < i + FILE_NODE_MAX; j++) {
+        BRANCH(parent)->sizes[parent->count] = node_size(nodes[j]);
+        BRANCH(parent)->children[parent->count++] = nodes[j];
+      }
+      nodes[parents++] = parent;
+    }
+    len = parents;
+  }
+  return nodes[0];
+}
+
+/* Moves the upper half of a full node into a new sibling and returns it. */
+static struct file_node *node_split(struct file_node *n) {
+  struct file_node *sibling = node_new(n->leaf);
+  int half = n->count / 2;
+  sibling->count = n->count - half;
+  if (n->leaf) {
+    memcpy(LEAF(sibling)->lines, &LEAF(n)->lines[half],
+           sizeof(struct line) * sibling->count);
+  } else {
+    memcpy(BRANCH(sibling)->sizes, &BRANCH(n)->sizes[half],
+           sizeof(size_t) * sibling->count);
+    memcpy(BRANCH(sibling)->children, &BRANCH(n)->children[half],
+           sizeof(struct file_node *) * sibling->count);
+  }
+  n->count = half;
+  return sibling;
+}
+
+/* Inserts a child into a branch at the provided position, splitting the branch
+ * if it is full. Returns the new sibling if the branch was split. */
+static struct file_node *branch_insert(struct file_node *n, int pos,
+                                       struct file_node *child, size_t size) {
+  struct file_node *sibling = NULL;
+  if (n->count == FILE_NODE_MAX) {
+    sibling = node_split(n);
+    if (pos > n->count) {
+      pos -= n->count;
+      n = sibling;
+    }
+  }
+
+  struct file_branch *b = BRANCH(n);
+  memmove(&b->sizes[pos + 1], &b->sizes[pos],
+          sizeof(size_t) * (n->count - pos));
+  memmove(&b->children[pos + 1], &b->children[pos],
+          sizeof(struct file_node *) * (n->count - pos));
+  b->sizes[pos] = size;
+  b->children[pos] = child;
+  n->count++;
+  return sibling;
+}
+
+/* Inserts the line at the provided index below the node. Returns the new
+ * sibling if the node had to be split. */
+static struct file_node *node_insert(struct file_node *n, size_t at,
+                                     struct line *line) {
+  if (n->leaf) {
+    struct file_node *sibling = NULL;
+    if (n->count == FILE_NODE_MAX) {
+      sibling = node_split(n);
+      if (at > n->count) {
+        at -= n->count;
+        n = sibling;
+      }
+    }
+
+    struct file_leaf *leaf = LEAF(n);
+    memmove(&leaf->lines[at + 1], &leaf->lines[at],
+            sizeof(struct line) * (n->count - at));
+    leaf->lines[at] = *line;
+    n->count++;
+    return sibling;
+  }
+
+  struct file_branch *b = BRANCH(n);
+  int i = 0;
+  while (i < n->count - 1 && at > b->sizes[i])
+    at -= b->sizes[i++];
+
+  struct file_node *child_sibling = node_insert(b->children[i], at, line);
+  if (!child_sibling) {
+    b->sizes[i]++;
+    return NULL;
+  }
+
+  b->sizes[i] = node_size(b->children[i]);
+  return branch_insert(n, i + 1, child_sibling, node_size(child_sibling));
+}
+
+/* Splits the leaf holding the line at the provided index below the node so
+ * that the line is the first of its leaf. Returns the new sibling if the node
+ * had to be split. */
+static struct file_node *node_cut(struct file_node *n, size_t at) {
+  if (n->leaf) {
+    if (at == 0 || at >= n->count)
+      return NULL;
+
+    struct file_node *sibling = node_new(1);
+    sibling->count = n->count - at;
+    memcpy(LEAF(sibling)->lines, &LEAF(n)->lines[at],
+           sizeof(struct line) * sibling->count);
+    n->count = at;
+    return sibling;
+  }
+
+  struct file_branch *b = BRANCH(n);
+  int i = 0;
+  while (i < n->count - 1 && at >= b->sizes[i])
+    at -= b->sizes[i++];
+
+  struct file_node *child_sibling = node_cut(b->children[i], at);
+  if (!child_sibling)
+    return NULL;
+
+  b->sizes[i] = node_size(b->children[i]);
+  return branch_insert(n, i + 1, child_sibling, node_size(child_sibling));
+}
+
+/* Inserts a leaf below the branch so that its first line ends up at the
+ * provided index, which must be the start of a leaf. Returns the new sibling
+ * if the branch had to be split. */
+static struct file_node *node_insert_leaf(struct file_node *n, size_t at,
+                                          struct file_node *leaf) {
+  struct file_branch *b = BRANCH(n);
+  int i = 0;
+  if (b->children[0]->leaf) {
+    while (i < n->count && at > 0)
+      at -= b->sizes[i++];
+    return branch_insert(n, i, leaf, leaf->count);
+  }
+
+  while (i < n->count - 1 && at > b->sizes[i])
+    at -= b->sizes[i++];
+
+  struct file_node *child_sibling = node_insert_leaf(b->children[i], at, leaf);
+  if (!child_sibling) {
+    b->sizes[i] += leaf->count;
+    return NULL;
+  }
+
+  b->sizes[i] = node_size(b->children[i]);
+  return branch_insert(n, i + 1, child_sibling, node_size(child_sibling));
+}
+
+/* Moves the contents of the child at i + 1 into the child at i. */
+static void branch_merge(struct file_node *n, int i) {
+  struct file_branch *b = BRANCH(n);
+  struct file_node *left = b->children[i], *right = b->children[i + 1];
+  if (left->leaf) {
+    memcpy(&LEAF(left)->lines[left->count], LEAF(right)->lines,
+           sizeof(struct line) * right->count);
+  } else {
+    memcpy(&BRANCH(left)->sizes[left->count], BRANCH(right)->sizes,
+           sizeof(size_t) * right->count);
+    memcpy(&BRANCH(left)->children[left->count], BRANCH(right)->children,
+           sizeof(struct file_node *) * right->count);
+  }
+  left->count += right->count;
+  b->sizes[i] += b->sizes[i + 1];
+  free(right);
+
+  memmove(&b->sizes[i + 1], &b->sizes[i + 2],
+          sizeof(size_t) * (n->count - i - 2));
+  memmove(&b->children[i + 1], &b->children[i + 2],
+          sizeof(struct file_node *) * (n->count - i - 2));
+  n->count--;
+}
+
+/* Deletes count lines from the provided index below the node, moving them to
+ * out unless it is NULL. Children that are covered completely are freed whole,
+ * and children left small are merged with a neighbour so the tree stays
+ * shallow. */
+static void node_delete(struct file_node *n, size_t at, size_t count,
+                        struct line *out) {
+  if (n->leaf) {
+    struct file_leaf *leaf = LEAF(n);
+    for (size_t i = at; i < at + count; i++) {
+      if (!out)
+        file_line_free(&leaf->lines[i]);
+      file_line_changed(&leaf->lines[i]);
+    }
+    if (out)
+      memcpy(out, &leaf->lines[at], sizeof(struct line) * count);
+    memmove(&leaf->lines[at], &leaf->lines[at + count],
+            sizeof(struct line) * (n->count - at - count));
+    n->count -= count;
+    return;
+  }
 
-  while ((read = getline(&line, &len, fp)) != -1) {
-    if (read != -1) {
-      while (read > 0 && (line[read - 1] == '\r' || line[read - 1] == '\n'))
-        read--;
+  struct file_branch *b = BRANCH(n);
+  int i = 0;
+  while (at >= b->sizes[i])
+    at -= b->sizes[i++];
 
-      f->lines = realloc(f->lines, sizeof(struct line) * (f->len + 1));
-      f->lines[f->len].chars = malloc(read + 1);
-      memcpy(f->lines[f->len].chars, line, read);
-      f->lines[f->len].chars[read] = '\0';
-      f->lines[f->len++].len = read;
+  int first = i;
+  while (count > 0) {
+    size_t len = b->sizes[i] - at < count ? b->sizes[i] - at : count;
+    if (len == b->sizes[i]) {
+      if (out)
+        node_take(b->children[i], out);
+      else
+        node_free(b->children[i]);
+      memmove(&b->sizes[i], &b->sizes[i + 1],
+              sizeof(size_t) * (n->count - i - 1));
+      memmove(&b->children[i], &b->children[i + 1],
+              sizeof(struct file_node *) * (n->count - i - 1));
+      n->count--;
+    } else {
+      node_delete(b->children[i], at, len, out);
+      b->sizes[i] -= len;
+      i++;
     }
+    if (out)
+      out += len;
+    count -= len;
+    at = 0;
+  }
+
+  /* Only the children at either end of the range were trimmed. */
+  for (int j = first; j <= i && j < n->count && n->count > 1; j++) {
+    struct file_node *child = b->children[j];
+    if (child->count >= FILE_NODE_MAX / 4)
+      continue;
+
+    if (j + 1 < n->count &&
+        child->count + b->children[j + 1]->count <= FILE_NODE_MAX)
+      branch_merge(n, j);
+    else if (j > 0 &&
+             child->count + b->children[j - 1]->count <= FILE_NODE_MAX)
+      branch_merge(n, --j);
+  }
+}
+
+/* Puts a new root above the current one and the sibling it was split into,
+ * if any. */
+static void file_grow(struct file *f, struct file_node *sibling) {
+  if (!sibling)
+    return;
+
+  struct file_node *root = node_new(0);
+  BRANCH(root)->sizes[0] = node_size(f->root);
+  BRANCH(root)->children[0] = f->root;
+  BRANCH(root)->sizes[1] = node_size(sibling);
+  BRANCH(root)->children[1] = sibling;
+  root->count = 2;
+  f->root = root;
+}
+
+/* Puts a branch above the root if it is a leaf, so that whole leaves can be
+ * inserted below it. */
+static void file_branch_root(struct file *f) {
+  if (!f->root->leaf)
+    return;
+
+  struct file_node *root = node_new(0);
+  BRANCH(root)->sizes[0] = f->root->count;
+  BRANCH(root)->children[0] = f->root;
+  root->count = 1;
+  f->root = root;
+}
+
+/* Number of leaves of lines read before file_open returns, enough to draw the
+ * first screen. The rest of the file is read in the background. */
+#define FILE_LOAD_FIRST 16
+
+/* Number of leaves the loader reads before handing them over. */
+#define FILE_LOAD_BATCH 256
+
+/* Reads the lines of a file on a background thread. */
+struct file_loader {
+  pthread_t thread;
+  const char *map;
+  size_t map_len;
+
+  /* Position where the loader starts reading. */
+  const char *start;
+
+  pthread_mutex_t lock;
+
+  /* Leaves read but not yet added to the file. Guarded by lock. */
+  struct file_node **leaves;
+  size_t leaves_len;
+  size_t leaves_cap;
+
+  /* Number of bytes of the file read so far, and whether the loader is done
+   * or asked to stop. Guarded by lock. */
+  size_t read;
+  int done;
+  int cancel;
+
+  /* Large files are scanned through fd instead of the mapping. The scan
+   * position and the number of lines before it belong to the scan. */
+  int fd;
+  off_t pos;
+  size_t pos_lines;
+
+  /* Checkpoints found in a large file but not yet added to its index, and the
+   * number of lines in the file once it is done. Guarded by lock. */
+  off_t *offsets;
+  size_t offsets_len;
+  size_t offsets_cap;
+  size_t lines;
+};
+
+/* Finds the end of the line starting at p. Stores its length in *len and
+ * returns the position after its line ending, which is "\n" or "\r\n". */
+static const char *file_split_line(const char *p, const char *end,
+                                   size_t *len) {
+  for (const char *eol = p;; eol++) {
+    eol = split_find_eol(eol, end);
+    if (eol == end) {
+      *len = end - p;
+      return end;
+    }
+    if (*eol == '\n' || (eol + 1 < end && eol[1] == '\n')) {
+      *len = eol - p;
+      return eol + (*eol == '\r' ? 2 : 1);
+    }
+  }
+}
+
+/* Like file_split_line, but ends lines longer than max after max characters,
+ * the rest being read as the next line. */
+static const char *file_split_line_max(const char *p, const char *end,
+                                       size_t *len, size_t max) {
+  const char *next = file_split_line(p, end, len);
+  if (*len <= max)
+    return next;
+  *len = max;
+  return p + max;
+}
+
+/* Returns whether the first line of the text ends in "\r\n". */
+static int file_detect_crlf(const char *p, size_t len) {
+  const char *nl = memchr(p, '\n', len);
+  return nl && nl > p && nl[-1] == '\r';
+}
+
+/* Splits the text from p up to end into lines and packs them into new full
+ * leaves, stopping when max leaves are full. Stores the number of leaves in
+ * *len and returns the position after the last line read. */
+static const char *file_read_leaves(const char *p, const char *end,
+                                    struct file_node **leaves, size_t max,
+                                    size_t *len) {
+  struct file_node *leaf = NULL;
+  *len = 0;
+  while (p < end) {
+    if (!leaf || leaf->count == FILE_NODE_MAX) {
+      if (*len == max)
+        break;
+      leaf = leaves[(*len)++] = node_new(1);
+    }
+
+    size_t line_len;
+    const char *next = file_split_line(p, end, &line_len);
+
+    /* Empty lines point at a literal so that chars[0] is always readable. */
+    LEAF(leaf)->lines[leaf->count++] =
+        (struct line){line_len > 0 ? (char *)p : "", line_len, 0, NULL};
+    p = next;
+  }
+  return p;
+}
+
+static void *file_load_thread(void *arg) {
+  struct file_loader *loader = arg;
+  struct file_node *leaves[FILE_LOAD_BATCH];
+  const char *p = loader->start, *end = loader->map + loader->map_len;
+
+  int cancel = 0;
+  while (p < end && !cancel) {
+    size_t len;
+    p = file_read_leaves(p, end, leaves, FILE_LOAD_BATCH, &len);
+
+    pthread_mutex_lock(&loader->lock);
+    if (loader->leaves_len + len > loader->leaves_cap) {
+      while (loader->leaves_len + len > loader->leaves_cap)
+        loader->leaves_cap = loader->leaves_cap ? loader->leaves_cap * 2
+                                                : FILE_LOAD_BATCH;
+      loader->leaves = realloc(loader->leaves, sizeof(struct file_node *) *
+                                                   loader->leaves_cap);
+    }
+    memcpy(&loader->leaves[loader->leaves_len], leaves,
+           sizeof(struct file_node *) * len);
+    loader->leaves_len += len;
+    loader->read = p - loader->map;
+    cancel = loader->cancel;
+    pthread_mutex_unlock(&loader->lock);
+  }
+
+  pthread_mutex_lock(&loader->lock);
+  loader->done = 1;
+  pthread_mutex_unlock(&loader->lock);
+  return NULL;
+}
+
+/* Number of lines between the checkpoints of the index of a large file. */
+#define FILE_INDEX_STEP 1024
+
+/* Size of the chunks a large file is scanned in. */
+#define FILE_INDEX_CHUNK (1 << 20)
+
+/* Number of blocks of FILE_INDEX_STEP lines of a large file kept mapped. */
+#define FILE_INDEX_BLOCKS 4
+
+/* Lines of a large file starting at a checkpoint, with the part of the file
+ * they are in mapped. */
+struct file_block {
+  size_t checkpoint;
+  char *map;
+  size_t map_len;
+  struct line lines[FILE_INDEX_STEP];
+  size_t count;
+};
+
+/* Sparse index of a file too large to keep every line in memory. Only the
+ * offset of every FILE_INDEX_STEP-th line is stored, and the lines around it
+ * are split up when they are needed. */
+struct file_index {
+  int fd;
+
+  /* Offset of the line at every multiple of FILE_INDEX_STEP, followed by the
+   * offset of the end of the last line if it ends a step. */
+  off_t *offsets;
+  size_t offsets_len;
+  size_t offsets_cap;
+
+  /* Most recently used blocks, reused round robin. */
+  struct file_block *blocks[FILE_INDEX_BLOCKS];
+  int next_block;
+};
+
+/* Scans the large file from the loader's position for newlines, staging a
+ * checkpoint every FILE_INDEX_STEP lines, until the end of the file or until
+ * max lines have been counted. */
+static void file_index_scan(struct file_loader *loader, size_t max) {
+  char *buf = malloc(FILE_INDEX_CHUNK);
+  off_t checkpoints[FILE_INDEX_CHUNK / FILE_INDEX_STEP + 1];
+  char last = '\n';
+
+  int cancel = 0;
+  while (loader->pos < loader->map_len && loader->pos_lines < max && !cancel) {
+    ssize_t n = pread(loader->fd, buf, FILE_INDEX_CHUNK, loader->pos);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+
+    size_t len = 0;
+    const char *p = buf, *end = buf + n;
+    while (p < end) {
+      size_t step = FILE_INDEX_STEP - loader->pos_lines % FILE_INDEX_STEP;
+      size_t left = step;
+      p = split_skip_lines(p, end, &left);
+      loader->pos_lines += step - left;
+      if (left == 0)
+        checkpoints[len++] = loader->pos + (p - buf);
+    }
+    loader->pos += n;
+    last = buf[n - 1];
+
+    pthread_mutex_lock(&loader->lock);
+    if (loader->offsets_len + len > loader->offsets_cap) {
+      while (loader->offsets_len + len > loader->offsets_cap)
+        loader->offsets_cap *= 2;
+      loader->offsets =
+          realloc(loader->offsets, sizeof(off_t) * loader->offsets_cap);
+    }
+    memcpy(&loader->offsets[loader->offsets_len], checkpoints,
+           sizeof(off_t) * len);
+    loader->offsets_len += len;
+    loader->read = loader->pos;
+    cancel = loader->cancel;
+    pthread_mutex_unlock(&loader->lock);
+  }
+  free(buf);
+
+  if (loader->pos < loader->map_len && !cancel && loader->pos_lines >= max)
+    return;
+
+  /* A last line without a newline still counts, and an empty file has one
+   * empty line. */
+  pthread_mutex_lock(&loader->lock);
+  loader->lines = loader->pos_lines + (last != '\n');
+  if (loader->lines == 0)
+    loader->lines = 1;
+  loader->done = 1;
+  pthread_mutex_unlock(&loader->lock);
+}
+
+static void *file_index_thread(void *arg) {
+  file_index_scan(arg, SIZE_MAX);
+  return NULL;
+}
+
+/* Unmaps the block and drops the state cached for its lines. */
+static void file_block_free(struct file_block *block) {
+  for (size_t i = 0; i < block->count; i++)
+    file_line_changed(&block->lines[i]);
+  if (block->map)
+    munmap(block->map, block->map_len);
+  free(block);
+}
+
+/* Maps the part of the large file holding the lines from the provided
+ * checkpoint and splits it into lines. */
+static struct file_block *file_block_read(struct file *f, size_t checkpoint) {
+  struct file_index *index = f->index;
+  struct file_block *block = malloc(sizeof(struct file_block));
+  block->checkpoint = checkpoint;
+  block->map = NULL;
+  block->map_len = 0;
+  block->count = f->len - checkpoint * FILE_INDEX_STEP;
+  if (block->count > FILE_INDEX_STEP)
+    block->count = FILE_INDEX_STEP;
+
+  /* Mappings must start on a page boundary. */
+  off_t start = index->offsets[checkpoint];
+  off_t end = checkpoint + 1 < index->offsets_len
+                  ? index->offsets[checkpoint + 1]
+                  : (off_t)f->map_len;
+  if (end > (off_t)f->intact)
+    end = f->intact;
+  off_t page = start & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+  const char *p = "", *p_end = p;
+  if (end > start) {
+    void *addr =
+        mmap(NULL, end - page, PROT_READ, MAP_PRIVATE, index->fd, page);
+    if (addr != MAP_FAILED) {
+      block->map = addr;
+      block->map_len = end - page;
+      p = block->map + (start - page);
+      p_end = block->map + block->map_len;
+    }
+  }
+
+  /* The file is read-only, so lines too long to hold are only shown cut. */
+  for (size_t i = 0; i < block->count; i++) {
+    size_t len;
+    const char *next = file_split_line(p, p_end, &len);
+    if (len > LINE_LEN_MAX)
+      len = LINE_LEN_MAX;
+    block->lines[i] = (struct line){len > 0 ? (char *)p : "", len, 0, NULL};
+    p = next;
+  }
+  return block;
+}
+
+/* Returns the block of a large file holding the line at the provided
+ * index. */
+static struct file_block *file_index_block(struct file *f, size_t at) {
+  struct file_index *index = f->index;
+  size_t checkpoint = at / FILE_INDEX_STEP;
+  for (int i = 0; i < FILE_INDEX_BLOCKS; i++) {
+    struct file_block *block = index->blocks[i];
+    if (block && block->checkpoint == checkpoint)
+      return block;
+  }
+
+  struct file_block **slot = &index->blocks[index->next_block];
+  index->next_block = (index->next_block + 1) % FILE_INDEX_BLOCKS;
+  if (*slot)
+    file_block_free(*slot);
+  *slot = file_block_read(f, checkpoint);
+  return *slot;
+}
+
+static void file_index_free(struct file_index *index) {
+  for (int i = 0; i < FILE_INDEX_BLOCKS; i++) {
+    if (index->blocks[i])
+      file_block_free(index->blocks[i]);
+  }
+  free(index->offsets);
+  close(index->fd);
+  free(index);
+}
+
+/* Frees the loader and the lines it read that were not added to the file. */
+static void file_load_free(struct file_loader *loader) {
+  for (size_t i = 0; i < loader->leaves_len; i++)
+    node_free(loader->leaves[i]);
+  free(loader->leaves);
+  free(loader->offsets);
+  pthread_mutex_destroy(&loader->lock);
+  free(loader);
+}
+
+/* Adds the leaves read so far by the loader to the end of the file. Stores
+ * whether the loader is done in *done and returns the number of bytes of the
+ * file it has read. */
+static size_t file_load_take(struct file *f, int *done) {
+  struct file_loader *loader = f->loader;
+  pthread_mutex_lock(&loader->lock);
+  struct file_node **leaves = loader->leaves;
+  size_t leaves_len = loader->leaves_len;
+  loader->leaves = NULL;
+  loader->leaves_len = 0;
+  loader->leaves_cap = 0;
+  size_t read = loader->read;
+  *done = loader->done;
+
+  if (f->index) {
+    struct file_index *index = f->index;
+    if (index->offsets_len + loader->offsets_len > index->offsets_cap) {
+      while (index->offsets_len + loader->offsets_len > index->offsets_cap)
+        index->offsets_cap *= 2;
+      index->offsets =
+          realloc(index->offsets, sizeof(off_t) * index->offsets_cap);
+    }
+    memcpy(&index->offsets[index->offsets_len], loader->offsets,
+           sizeof(off_t) * loader->offsets_len);
+    index->offsets_len += loader->offsets_len;
+    loader->offsets_len = 0;
+
+    /* Until the scan is done only the lines before the last checkpoint are
+     * known to be complete. */
+    f->len = *done ? loader->lines
+                   : (index->offsets_len - 1) * FILE_INDEX_STEP;
+  }
+  pthread_mutex_unlock(&loader->lock);
+
+  /* The lines that have not been read yet come after every line in the file,
+   * so new leaves always go at the end. */
+  if (leaves_len > 0)
+    file_branch_root(f);
+  for (size_t i = 0; i < leaves_len; i++) {
+    file_grow(f, node_insert_leaf(f->root, f->len, leaves[i]));
+    f->len += leaves[i]->count;
+  }
+  free(leaves);
+  return read;
+}
+
+/* Adds the last lines read by the loader, which must have stopped, and frees
+ * it. */
+static void file_load_finish(struct file *f) {
+  int done;
+  file_load_take(f, &done);
+  file_load_free(f->loader);
+  f->loader = NULL;
+}
+
+/* Opens a file too large to keep in memory. It is scanned for newlines to
+ * build a sparse index, and only the parts that are looked at are mapped. */
+static struct file *file_open_large(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return NULL;
+  }
+
+  struct file *f = malloc(sizeof(struct file));
+  *f = (struct file){NULL, 0, NULL, st.st_size, fd,
+                     st.st_size, NULL, 0, NULL, NULL, NULL, 0};
+
+  struct file_index *index = calloc(1, sizeof(struct file_index));
+  index->fd = fd;
+  index->offsets_cap = FILE_INDEX_CHUNK / FILE_INDEX_STEP + 1;
+  index->offsets = malloc(sizeof(off_t) * index->offsets_cap);
+  index->offsets[index->offsets_len++] = 0;
+  f->index = index;
+
+  struct file_loader *loader = calloc(1, sizeof(struct file_loader));
+  loader->map_len = st.st_size;
+  loader->fd = fd;
+  loader->offsets_cap = FILE_INDEX_CHUNK / FILE_INDEX_STEP + 1;
+  loader->offsets = malloc(sizeof(off_t) * loader->offsets_cap);
+  pthread_mutex_init(&loader->lock, NULL);
+  f->loader = loader;
+
+  /* The start of the file is scanned here so the first screen can be drawn,
+   * and the rest in the background. */
+  file_index_scan(loader, FILE_LOAD_FIRST * FILE_NODE_MAX);
+  int done;
+  file_load_take(f, &done);
+  if (!done &&
+      pthread_create(&loader->thread, NULL, file_index_thread, loader) == 0)
+    return f;
+
+  /* Without a thread the rest of the file is scanned here instead. */
+  if (!done)
+    file_index_scan(loader, SIZE_MAX);
+  file_load_finish(f);
+  return f;
+}
+
+struct file *file_open(const char *path) {
+  STATS_START(start);
+  struct stat st;
+  if (stat(path, &st) == 0 && st.st_size >= FILE_LARGE_SIZE) {
+    struct file *f = file_open_large(path);
+    STATS_STOP(open_ns, start);
+    return f;
+  }
+
+  char *map;
+  size_t map_len;
+  int fd = file_map(path, &map, &map_len, &st);
+  if (fd == -1)
+    return NULL;
+
+  struct file *f = malloc(sizeof(struct file));
+  *f = (struct file){NULL, 0, map, map_len, fd,
+                     map_len, NULL, 0, NULL, NULL, NULL, 0};
+  f->crlf = map && file_detect_crlf(map, map_len);
+  f->dev = st.st_dev;
+  f->ino = st.st_ino;
+  f->size = map_len;
+  /* The only row of an empty file is continued by what is appended too. */
+  f->partial = map_len == 0 || map[map_len - 1] != '\n';
+
+  /* Only the start of the file is read here. Lines are packed into full
+   * leaves which are then grouped into branches. */
+  struct file_node *leaves[FILE_LOAD_FIRST];
+  size_t leaves_len;
+  const char *end = map + map_len;
+  const char *p =
+      file_read_leaves(map, end, leaves, FILE_LOAD_FIRST, &leaves_len);
+
+  if (leaves_len == 0) {
+    leaves[leaves_len++] = node_new(1);
+    LEAF(leaves[0])->lines[leaves[0]->count++] = (struct line){"", 0, 0, NULL};
   }
 
-  free(line);
-  fclose(fp);
+  f->root = node_build(leaves, leaves_len);
+  f->len = node_size(f->root);
+
+  if (p < end) {
+    struct file_loader *loader = calloc(1, sizeof(struct file_loader));
+    loader->map = map;
+    loader->map_len = map_len;
+    loader->start = p;
+    loader->read = p - map;
+    pthread_mutex_init(&loader->lock, NULL);
+    f->loader = loader;
 
+    /* Without a thread the rest of the file is read here instead. */
+    if (pthread_create(&loader->thread, NULL, file_load_thread, loader) != 0) {
+      file_load_thread(loader);
+      file_load_finish(f);
+    }
+  }
+
+  STATS_STOP(open_ns, start);
   return f;
 }
 
+int file_load(struct file *f) {
+  if (!f->loader)
+    return 100;
+
+  int done;
+  size_t read = file_load_take(f, &done);
+  if (!done) {
+    int percent = read * 100 / f->map_len;
+    return percent < 100 ? percent : 99;
+  }
+
+  pthread_join(f->loader->thread, NULL);
+  file_load_finish(f);
+  return 100;
+}
+
+void file_load_wait(struct file *f) {
+  if (!f->loader)
+    return;
+
+  pthread_join(f->loader->thread, NULL);
+  file_load_finish(f);
+}
+
+/* Size of the pieces the text appended to a followed file is read in. */
+#define FILE_FOLLOW_CHUNK (1 << 20)
+
+/* Adds text read from the end of a followed file. Its first line continues the
+ * last row if that has no line ending yet, and the other lines are added as
+ * new rows in a single insertion. Lines growing past LINE_LEN_MAX go on in a
+ * new row. */
+static void file_follow_text(struct file *f, const char *p, const char *end) {
+  size_t line_len;
+  if (f->partial) {
+    struct line *last = file_line(f, f->len - 1);
+    const char *next =
+        file_split_line_max(p, end, &line_len, LINE_LEN_MAX - last->len);
+    edit_append_string(last, p, line_len);
+    p = next;
+  }
+
+  struct line *lines = NULL;
+  size_t n = 0, cap = 0;
+  while (p < end) {
+    const char *next = file_split_line_max(p, end, &line_len, LINE_LEN_MAX);
+    if (n == cap) {
+      cap = cap ? cap * 2 : 64;
+      lines = realloc(lines, sizeof(struct line) * cap);
+    }
+    lines[n++] = file_new_line(f, p, line_len);
+    p = next;
+  }
+  file_insert_rows(f, f->len, lines, n);
+  free(lines);
+  f->partial = end[-1] != '\n';
+}
+
+enum file_follow file_follow(struct file *f, const char *path) {
+  if (f->index || f->loader)
+    return FILE_FOLLOW_SAME;
+
+  /* A file that was rotated away and not created again yet is kept. */
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return FILE_FOLLOW_SAME;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == f->size) {
+    close(fd);
+    return FILE_FOLLOW_SAME;
+  }
+  if (st.st_dev != f->dev || st.st_ino != f->ino || st.st_size < f->size) {
+    close(fd);
+    return FILE_FOLLOW_REPLACED;
+  }
+
+  /* The appended text is read a piece at a time, the last line of each piece
+   * being continued by the next like a line written in several goes. A
+   * "\r\n" is kept within one piece. */
+  char *buf = malloc(FILE_FOLLOW_CHUNK);
+  off_t size = f->size;
+  while (f->size < st.st_size) {
+    size_t want = st.st_size - f->size;
+    if (want > FILE_FOLLOW_CHUNK)
+      want = FILE_FOLLOW_CHUNK;
+    ssize_t n = pread(fd, buf, want, f->size);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    if (n > 1 && buf[n - 1] == '\r' && f->size + n < st.st_size)
+      n--;
+    file_follow_text(f, buf, buf + n);
+    f->size += n;
+  }
+  close(fd);
+  free(buf);
+  return f->size > size ? FILE_FOLLOW_GREW : FILE_FOLLOW_SAME;
+}
+
 void file_close(struct file *f) {
-  for (size_t i = 0; i < f->len; i++) {
-    free(f->lines[i].chars);
+  file_save_wait(f);
+
+  if (f->loader) {
+    pthread_mutex_lock(&f->loader->lock);
+    f->loader->cancel = 1;
+    pthread_mutex_unlock(&f->loader->lock);
+    pthread_join(f->loader->thread, NULL);
+    file_load_free(f->loader);
+  }
+
+  if (f->index) {
+    file_index_free(f->index);
+  } else {
+    node_free(f->root);
+    close(f->fd);
+  }
+  if (f->map)
+    munmap(f->map, f->map_len);
+  while (f->chunks) {
+    struct file_chunk *next = f->chunks->next;
+    free(f->chunks);
+    f->chunks = next;
   }
-  free(f->lines);
   free(f);
 }
 
-void file_save(struct file *f, const char *path) {
-  FILE *fp = fopen(path, "w");
-  if (!fp) {
+/* Part of a mapping from start up to end, and the point in it where the file
+ * now ends. */
+struct file_cut {
+  const char *start;
+  const char *end;
+  const char *cut;
+};
+
+/* Cuts the line where the file now ends if it points into the mapping. */
+static void file_cut_line(struct line *line, void *arg) {
+  struct file_cut *cut = arg;
+  if (line->cap > 0 || line->chars < cut->start || line->chars >= cut->end ||
+      line->chars + line->len <= cut->cut)
     return;
+  file_line_changed(line);
+  if (line->chars >= cut->cut)
+    *line = (struct line){"", 0, 0, NULL};
+  else
+    line->len = cut->cut - line->chars;
+}
+
+/* Replaces the pages of the mapping of len bytes made from the provided
+ * offset of the file that lie past the first size bytes of the file with
+ * zeroed pages, and cuts the lines pointing there. Reading them then no longer
+ * faults. */
+static void file_cut_map(char *map, size_t len, off_t offset, size_t size,
+                         struct file_node *root, struct line *lines,
+                         size_t lines_len) {
+  if (!map || offset + len <= size)
+    return;
+
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t keep = size > (size_t)offset ? size - offset : 0;
+  size_t from = (keep + page - 1) & ~(page - 1);
+  if (from < len)
+    mmap(map + from, len - from, PROT_READ,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+
+  struct file_cut cut = {map, map + len, map + keep};
+  if (root)
+    node_walk(root, file_cut_line, &cut);
+  for (size_t i = 0; i < lines_len; i++)
+    file_cut_line(&lines[i], &cut);
+}
+
+int file_check(struct file *f) {
+  struct stat st;
+  if (fstat(f->fd, &st) == -1 || (size_t)st.st_size >= f->intact)
+    return 0;
+
+  f->intact = st.st_size;
+  if (!f->index) {
+    file_cut_map(f->map, f->map_len, 0, f->intact, f->root, NULL, 0);
+    return 1;
+  }
+
+  size_t page = sysconf(_SC_PAGESIZE);
+  for (int i = 0; i < FILE_INDEX_BLOCKS; i++) {
+    struct file_block *block = f->index->blocks[i];
+    if (block)
+      file_cut_map(block->map, block->map_len,
+                   f->index->offsets[block->checkpoint] & ~(off_t)(page - 1),
+                   f->intact, NULL, block->lines, block->count);
+  }
+  return 1;
+}
+
+/* Contents of a file captured for saving. Unedited lines are written straight
+ * from the mapping or the chunks, which never change, and edited lines are
+ * copied, so the file can be edited while the snapshot is written. */
+struct file_save_job {
+  pthread_t thread;
+  char *path;
+  mode_t mode;
+
+  /* Pieces to write, in order, each ending in a newline. Pieces that follow
+   * each other in memory are merged, so runs of unedited lines are written
+   * with a single entry. */
+  struct iovec *iov;
+  size_t iov_len;
+  size_t iov_cap;
+
+  /* Edited lines, each followed by its line ending. */
+  char *copy;
+  size_t copy_len;
+
+  /* Result of the save, and whether the thread set it. done is accessed
+   * atomically. */
+  int result;
+  int done;
+};
+
+static void file_save_piece(struct file_save_job *job, char *p, size_t len) {
+  if (job->iov_len > 0) {
+    struct iovec *last = &job->iov[job->iov_len - 1];
+    if ((char *)last->iov_base + last->iov_len == p) {
+      last->iov_len += len;
+      return;
+    }
   }
 
-  for (size_t i = 0; i < f->len; i++) {
-    fwrite(f->lines[i].chars, f->lines[i].len, 1, fp);
-    fwrite("\n", 1, 1, fp);
+  if (job->iov_len == job->iov_cap) {
+    job->iov_cap = job->iov_cap ? job->iov_cap * 2 : 1024;
+    job->iov = realloc(job->iov, sizeof(struct iovec) * job->iov_cap);
   }
+  job->iov[job->iov_len++] = (struct iovec){p, len};
+}
+
+/* Adds the size of the copy of an edited line, with room for either line
+ * ending. */
+static void file_save_count(struct line *line, void *arg) {
+  if (line->cap > 0)
+    *(size_t *)arg += line->len + 2;
+}
+
+struct file_save_state {
+  struct file *f;
+  struct file_save_job *job;
+};
+
+static void file_save_line(struct line *line, void *arg) {
+  struct file_save_state *state = arg;
+  struct file_save_job *job = state->job;
+  struct file *f = state->f;
+  char *eol = f->crlf ? "\r\n" : "\n";
+  size_t eol_len = f->crlf ? 2 : 1;
+
+  if (line->cap > 0) {
+    char *p = job->copy + job->copy_len;
+    memcpy(p, line->chars, line->len);
+    memcpy(p + line->len, eol, eol_len);
+    job->copy_len += line->len + eol_len;
+    file_save_piece(job, p, line->len + eol_len);
+  } else if (line->len > 0 && line->chars >= f->map &&
+             line->chars + line->len + eol_len <= f->map + f->map_len &&
+             memcmp(line->chars + line->len, eol, eol_len) == 0) {
+    file_save_piece(job, line->chars, line->len + eol_len);
+  } else {
+    if (line->len > 0)
+      file_save_piece(job, line->chars, line->len);
+    file_save_piece(job, eol, eol_len);
+  }
+}
+
+static void file_save_free(struct file_save_job *job) {
+  free(job->path);
+  free(job->iov);
+  free(job->copy);
+  free(job);
+}
+
+/* Where the snapshot goes back to if the file is truncated under it while
+ * its lines are read. */
+static sigjmp_buf file_save_fault;
+
+static void file_save_bus(int sig) { siglongjmp(file_save_fault, 1); }
+
+/* Captures the contents of the file and the path and permissions to save them
+ * with. Returns NULL if the file was truncated on disk while its lines were
+ * read, which file_check would only have noticed afterwards. */
+static struct file_save_job *file_save_snapshot(struct file *f,
+                                                const char *path) {
+  struct file_save_job *job = calloc(1, sizeof(struct file_save_job));
+
+  /* Saving through a symlink replaces the file it points to. */
+  job->path = realpath(path, NULL);
+  if (!job->path)
+    job->path = strdup(path);
+
+  struct stat st;
+  if (stat(job->path, &st) == 0) {
+    job->mode = st.st_mode & 07777;
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    job->mode = 0666 & ~mask;
+  }
+
+  size_t copy_len = 0;
+  node_walk(f->root, file_save_count, &copy_len);
+  job->copy = malloc(copy_len + 1);
+
+  struct sigaction bus = {.sa_handler = file_save_bus}, old;
+  sigemptyset(&bus.sa_mask);
+  sigaction(SIGBUS, &bus, &old);
+  if (sigsetjmp(file_save_fault, 1)) {
+    sigaction(SIGBUS, &old, NULL);
+    file_save_free(job);
+    return NULL;
+  }
+  struct file_save_state state = {f, job};
+  node_walk(f->root, file_save_line, &state);
+  sigaction(SIGBUS, &old, NULL);
+  return job;
+}
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
-  fclose(fp);
+/* Writes all the pieces to fd, resuming after partial writes. */
+static int file_save_writev(int fd, struct iovec *iov, size_t len) {
+  while (len > 0) {
+    int n = len < IOV_MAX ? len : IOV_MAX;
+    ssize_t written = writev(fd, iov, n);
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    while (len > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      len--;
+    }
+    if (written > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+/* Writes the snapshot to a temporary file next to the target and renames it
+ * into place once it is safely on disk. */
+static int file_save_write(struct file_save_job *job) {
+  STATS_START(start);
+  size_t path_len = strlen(job->path);
+  char *tmp = malloc(path_len + sizeof(".XXXXXX"));
+  memcpy(tmp, job->path, path_len);
+  memcpy(tmp + path_len, ".XXXXXX", sizeof(".XXXXXX"));
+
+  int fd = mkstemp(tmp);
+  if (fd == -1) {
+    free(tmp);
+    return -1;
+  }
+
+  if (fchmod(fd, job->mode) == -1 ||
+      file_save_writev(fd, job->iov, job->iov_len) == -1 || fsync(fd) == -1) {
+    close(fd);
+    unlink(tmp);
+    free(tmp);
+    return -1;
+  }
+  close(fd);
+
+  if (rename(tmp, job->path) == -1) {
+    unlink(tmp);
+    free(tmp);
+    return -1;
+  }
+  free(tmp);
+
+  /* Make the rename itself durable. */
+  char *dir = strdup(job->path);
+  int dir_fd = open(dirname(dir), O_RDONLY);
+  if (dir_fd != -1) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+  free(dir);
+
+  STATS_STOP(save_ns, start);
+  return 0;
+}
+
+int file_save(struct file *f, const char *path) {
+  if (f->index)
+    return -1;
+  file_save_wait(f);
+  file_load_wait(f);
+
+  struct file_save_job *job = file_save_snapshot(f, path);
+  if (!job)
+    return -1;
+  int result = file_save_write(job);
+  file_save_free(job);
+  return result;
+}
+
+static void *file_save_thread(void *arg) {
+  struct file_save_job *job = arg;
+  job->result = file_save_write(job);
+  __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+int file_save_async(struct file *f, const char *path) {
+  if (f->index)
+    return -1;
+  file_save_wait(f);
+  file_load_wait(f);
+
+  struct file_save_job *job = file_save_snapshot(f, path);
+  if (!job)
+    return -1;
+  if (pthread_create(&job->thread, NULL, file_save_thread, job) != 0) {
+    file_save_free(job);
+    return -1;
+  }
+  f->save = job;
+  return 0;
+}
+
+int file_save_done(struct file *f) {
+  return !f->save || __atomic_load_n(&f->save->done, __ATOMIC_ACQUIRE);
+}
+
+int file_save_wait(struct file *f) {
+  if (!f->save)
+    return 0;
+
+  pthread_join(f->save->thread, NULL);
+  int result = f->save->result;
+  file_save_free(f->save);
+  f->save = NULL;
+  return result;
+}
+
+struct line *file_line(struct file *f, size_t at) {
+  size_t n;
+  return file_lines(f, at, &n);
+}
+
+struct line *file_lines(struct file *f, size_t at, size_t *n) {
+  if (f->index) {
+    struct file_block *block = file_index_block(f, at);
+    *n = block->count - at % FILE_INDEX_STEP;
+    return &block->lines[at % FILE_INDEX_STEP];
+  }
+
+  struct file_node *node = f->root;
+  while (!node->leaf) {
+    struct file_branch *b = BRANCH(node);
+    int i = 0;
+    while (at >= b->sizes[i])
+      at -= b->sizes[i++];
+    node = b->children[i];
+  }
+  *n = node->count - at;
+  return &LEAF(node)->lines[at];
+}
+
+struct line file_new_line(struct file *f, const char *s, size_t len) {
+  struct line line = {NULL, len, 0, NULL};
+  int room = f->chunks && FILE_CHUNK - f->chunks->used >= len + 1;
+  if (len >= FILE_CHUNK_LINE || (!room && f->chunks_len == FILE_CHUNKS_MAX)) {
+    line.chars = malloc(len + 1);
+    line.cap = len + 1;
+  } else {
+    if (!room) {
+      struct file_chunk *chunk = malloc(sizeof(struct file_chunk));
+      chunk->next = f->chunks;
+      chunk->used = 0;
+      f->chunks = chunk;
+      f->chunks_len++;
+    }
+    line.chars = f->chunks->chars + f->chunks->used;
+    f->chunks->used += len + 1;
+  }
+  memcpy(line.chars, s, len);
+  line.chars[len] = '\0';
+  return line;
+}
+
+void file_insert_row(struct file *f, int at, const char *s, size_t len) {
+  if (f->index || at < 0 || at > f->len)
+    return;
+
+  struct line line = file_new_line(f, s, len);
+  file_grow(f, node_insert(f->root, at, &line));
+  f->len++;
+}
+
+void file_split_row(struct file *f, int at, size_t col) {
+  /* The end is copied before the row is looked up again, since inserting a
+   * row can move it. */
+  struct line *line = file_line(f, at);
+  file_insert_row(f, at + 1, line->chars + col, line->len - col);
+  line = file_line(f, at);
+  edit_delete_string(line, col, line->len - col);
+}
+
+void file_insert_rows(struct file *f, int at, struct line *lines, size_t n) {
+  if (f->index || at < 0 || at > f->len)
+    return;
+
+  /* A few rows are cheaper to insert one by one than to give leaves of their
+   * own. */
+  if (n < FILE_NODE_MAX) {
+    for (size_t i = 0; i < n; i++)
+      file_grow(f, node_insert(f->root, at + i, &lines[i]));
+    f->len += n;
+    return;
+  }
+
+  file_branch_root(f);
+
+  /* Cut the tree at the insertion point and slot in full leaves of new
+   * rows. */
+  file_grow(f, node_cut(f->root, at));
+  for (size_t i = 0; i < n; i += FILE_NODE_MAX) {
+    struct file_node *leaf = node_new(1);
+    leaf->count = n - i < FILE_NODE_MAX ? n - i : FILE_NODE_MAX;
+    memcpy(LEAF(leaf)->lines, &lines[i], sizeof(struct line) * leaf->count);
+    file_grow(f, node_insert_leaf(f->root, at + i, leaf));
+  }
+  f->len += n;
+}
+
+/* Deletes n rows from the provided index, moving their lines to out unless it
+ * is NULL. Returns the number of rows deleted. */
+static size_t file_remove_rows(struct file *f, int at, size_t n,
+                               struct line *out) {
+  if (f->index || at < 0 || at >= f->len)
+    return 0;
+  if (n > f->len - at)
+    n = f->len - at;
+  size_t removed = n;
+
+  /* A file always has a line, so deleting every line empties the last one. */
+  int empty = n == f->len;
+  if (empty)
+    n--;
+
+  if (n > 0) {
+    node_delete(f->root, at, n, out);
+    f->len -= n;
+
+    /* Drop branches left with a single child. */
+    while (!f->root->leaf && f->root->count == 1) {
+      struct file_node *root = f->root;
+      f->root = BRANCH(root)->children[0];
+      free(root);
+    }
+  }
+
+  if (empty) {
+    struct line *line = file_line(f, 0);
+    file_line_changed(line);
+    if (out)
+      out[n] = *line;
+    else
+      file_line_free(line);
+    *line = (struct line){"", 0, 0, NULL};
+  }
+  return removed;
+}
+
+void file_delete_row(struct file *f, int at) { file_delete_rows(f, at, 1); }
+
+void file_delete_rows(struct file *f, int at, size_t n) {
+  file_remove_rows(f, at, n, NULL);
+}
+
+size_t file_take_rows(struct file *f, int at, size_t n, struct line *out) {
+  return file_remove_rows(f, at, n, out);
+}
+
+struct line_render line_render_plain;
+
+void file_line_changed(struct line *line) {
+  if (line->render != &line_render_plain)
+    free(line->render);
+  line->render = NULL;
+}
+
+void file_line_shift(struct line *line, size_t pos, long len) {
+  struct line_render *render = line->render;
+  if (!render || render == &line_render_plain)
+    return;
+  for (int i = render->tabs_len - 1; i >= 0 && (size_t)render->tabs[i] >= pos;
+       i--)
+    render->tabs[i] += len;
+}
+
+void file_line_cut(struct line *line, size_t pos) {
+  struct line_render *render = line->render;
+  if (!render || render == &line_render_plain)
+    return;
+  while (render->tabs_len > 0 &&
+         (size_t)render->tabs[render->tabs_len - 1] >= pos)
+    render->tabs_len--;
+}
+
+/* Returns the number of lines sharing the characters of a shared line, which
+ * is stored at the first multiple of 4 after its NUL. */
+static uint32_t *file_line_refs(struct line *line) {
+  return (uint32_t *)(line->chars + ((line->len + 4) & ~(size_t)3));
+}
+
+struct line file_share_line(struct line *line) {
+  if (line->cap > 0 && line->cap != LINE_SHARED) {
+    /* The count goes in the unused end of the buffer, which only has to
+     * grow if there is no room left. */
+    size_t size = ((line->len + 4) & ~(size_t)3) + sizeof(uint32_t);
+    if (line->cap < size)
+      line->chars = realloc(line->chars, size);
+    line->cap = LINE_SHARED;
+    *file_line_refs(line) = 1;
+  }
+  if (line->cap == LINE_SHARED)
+    (*file_line_refs(line))++;
+  return (struct line){line->chars, line->len, line->cap, NULL};
+}
+
+void file_line_free(struct line *line) {
+  if (line->cap == LINE_SHARED && --*file_line_refs(line) > 0)
+    return;
+  if (line->cap > 0)
+    free(line->chars);
 }
@@ -1,22 +1,234 @@
 #ifndef _FILE_H_
 #define _FILE_H_
 
+#include <stdint.h>
 #include <string.h>
+#include <sys/types.h>
 
+/* Display form of a line containing tabs: the file columns of its tabs, in
+ * order, from which the cells of any part of the line and the conversions
+ * between file and display columns follow. Found by the renderer the first
+ * time the line is drawn or the cursor moves on it, and dropped when the line
+ * is edited. */
+struct line_render {
+  int *tabs;
+  int tabs_len;
+};
+
+/* Display form cached on lines without tabs, which are displayed as they are.
+ * Shared by all such lines, so a line is only scanned for tabs once after
+ * each edit. */
+extern struct line_render line_render_plain;
+
+/* Marks lines sharing their characters with other lines, such as the lines
+ * of a register. The characters are then read-only like those of the file
+ * mapping, and the number of lines sharing them is kept after the NUL. */
+#define LINE_SHARED UINT32_MAX
+
+/* Longest line, so that lengths, sizes and columns fit in an int. Longer lines
+ * of a followed file are split into several rows, those of a large file are
+ * cut, and edits that would make a line longer are refused. */
+#define LINE_LEN_MAX INT32_MAX
+
+/* Files hold one line per row, so the line is kept at 24 bytes by storing its
+ * length and size in 32 bits. Lines are limited to LINE_LEN_MAX. */
 struct line {
+  /* Not NUL-terminated while the line still points into the file mapping. */
   char *chars;
-  size_t len;
+  uint32_t len;
+
+  /* Allocated size of chars. Zero when chars is not owned by the line because
+   * it points into the file mapping or into the chunks of the file, and
+   * LINE_SHARED when it is shared with other lines. */
+  uint32_t cap;
+
+  /* Cached display form, NULL until the line is drawn and &line_render_plain
+   * if it has no tabs. */
+  struct line_render *render;
 };
 
+/* Node of the tree holding the lines of a file. Leaves store runs of lines and
+ * branches store the number of lines below each child, so a line can be found,
+ * inserted or deleted in O(log n). */
+struct file_node;
+
+struct file_save_job;
+
+/* Block of memory that the characters of new short lines are packed into. */
+struct file_chunk;
+
+struct file_loader;
+
+struct file_index;
+
 struct file {
-  struct line *lines;
+  struct file_node *root;
   size_t len;
+
+  /* Read-only mapping of the file contents that unedited lines point into. */
+  char *map;
+  size_t map_len;
+
+  /* Descriptor the file was mapped from, kept open to notice the file being
+   * truncated under the mapping, and the number of bytes at its start that
+   * can still be read. For large files it belongs to the index. */
+  int fd;
+  size_t intact;
+
+  /* Chunks that short lines added to the file point into, in the same way,
+   * and their number. They are only freed with the file, so their number is
+   * bounded. */
+  struct file_chunk *chunks;
+  size_t chunks_len;
+
+  /* Save running in the background, NULL when there is none. */
+  struct file_save_job *save;
+
+  /* Reads the rest of the file in the background, NULL once the whole file
+   * has been read. */
+  struct file_loader *loader;
+
+  /* Sparse index of a file too large to keep every line in memory, NULL for
+   * other files. Such files are read-only and root and map are not used. */
+  struct file_index *index;
+
+  /* Set when the first line ends in "\r\n". Every line is then written back
+   * with "\r\n" when the file is saved, and with "\n" otherwise. */
+  int crlf;
+
+  /* Device, inode and size of the file on disk the rows were read from, and
+   * whether its last line has no line ending yet, so that text appended to
+   * the file is read as the rest of that line. Used to follow the file as it
+   * grows. */
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  int partial;
+};
+
+enum file_follow {
+  /* Nothing was appended to the file. */
+  FILE_FOLLOW_SAME,
+
+  /* Lines were appended, and the last row may have grown. */
+  FILE_FOLLOW_GREW,
+
+  /* The file was truncated, or replaced by another file at the same path,
+   * and must be opened again. */
+  FILE_FOLLOW_REPLACED,
 };
 
+/* Opens the file at path. Only the first lines are read before returning and
+ * the rest are read on a background thread and added with file_load. Lines
+ * may end in "\n" or "\r\n". Very large files are opened read-only with a
+ * sparse index. */
 struct file *file_open(const char *path);
 
+/* Adds the lines read in the background since the last call to the end of the
+ * file. Returns the percentage of the file read so far, 100 once all of it has
+ * been added. */
+int file_load(struct file *f);
+
+/* Waits until the whole file has been read and adds the remaining lines. */
+void file_load_wait(struct file *f);
+
+/* Adds the lines appended to the file at path since it was opened or last
+ * followed, reading only the new bytes. The first of them continues the last
+ * row if it had no line ending. Large files and files still being read are
+ * left as they are. */
+enum file_follow file_follow(struct file *f, const char *path);
+
 void file_close(struct file *f);
 
-void file_save(struct file *f, const char *path);
+/* Checks whether the file was truncated on disk by another program, in which
+ * case reading the lines past its new end would fault. Those lines are cut
+ * where the file now ends and the mapping past it is replaced with zeros.
+ * Returns 1 if the file was truncated since the last check. */
+int file_check(struct file *f);
+
+/* Writes the file to a temporary file next to path and renames it over path
+ * once it is on disk, so a failed save leaves the previous contents intact.
+ * Waits for the file to be read completely first. Returns 0 on success and -1
+ * on failure. */
+int file_save(struct file *f, const char *path);
+
+/* Like file_save but writes a snapshot of the file on a background thread, so
+ * the file can be edited while it is saved. Returns -1 if the save could not
+ * be started. */
+int file_save_async(struct file *f, const char *path);
+
+/* Returns 1 if no background save is running or it finished, so that
+ * file_save_wait returns without waiting. */
+int file_save_done(struct file *f);
+
+/* Waits for the background save to finish and returns its result, or 0 when
+ * none is running. */
+int file_save_wait(struct file *f);
+
+/* Returns the line at the provided index. The pointer is only valid until the
+ * next row is inserted or deleted, or for large files until lines far from it
+ * are looked up. */
+struct line *file_line(struct file *f, size_t at);
+
+/* Like file_line but also stores in *n the number of lines stored one after
+ * the other from the returned one, itself included, so that runs of rows can
+ * be read with a single lookup. */
+struct line *file_lines(struct file *f, size_t at, size_t *n);
+
+/* Returns a line holding a copy of the first len characters of s, which can
+ * then be inserted into the file. Short lines are packed into the chunks of
+ * the file rather than getting an allocation of their own, and get a buffer
+ * of their own once they are edited, like the lines of the file mapping. The
+ * chunks are kept until the file is closed, so once they reach a bounded
+ * size new lines get allocations of their own too. */
+struct line file_new_line(struct file *f, const char *s, size_t len);
+
+/* Returns a line with the same characters as the provided line, which both
+ * then share instead of copying them. Either gets a copy of its own once it
+ * is edited. Lines pointing into the file mapping or its chunks are returned
+ * as they are, and stay valid until the file is closed. */
+struct line file_share_line(struct line *line);
+
+/* Frees the characters owned by the line, or drops its share of them. */
+void file_line_free(struct line *line);
+
+/* Inserts a copy of the first len characters of s as a new row at the provided
+ * index. */
+void file_insert_row(struct file *f, int at, const char *s, size_t len);
+
+/* Moves the end of the row from the provided column to a new row below it. */
+void file_split_row(struct file *f, int at, size_t col);
+
+/* Inserts the n provided lines as new rows starting at the provided index.
+ * The file takes ownership of the lines' characters. Large batches are added
+ * as whole leaves, without touching the rows around them. */
+void file_insert_rows(struct file *f, int at, struct line *lines, size_t n);
+
+/* Deletes the row at the provided index. The only row of a file is emptied
+ * instead. */
+void file_delete_row(struct file *f, int at);
+
+/* Deletes n rows starting at the provided index, or as many as there are up to
+ * the end of the file, in a single pass over the tree. The file is left with
+ * one empty row if every row is deleted. */
+void file_delete_rows(struct file *f, int at, size_t n);
+
+/* Like file_delete_rows but moves the lines of the deleted rows to out, which
+ * must have room for n lines, instead of freeing them. Returns the number of
+ * rows deleted. */
+size_t file_take_rows(struct file *f, int at, size_t n, struct line *out);
+
+/* Drops the state cached for the line. Must be called whenever its characters
+ * change. */
+void file_line_changed(struct line *line);
+
+/* Updates the state cached for the line instead of dropping it, for len
+ * characters without tabs inserted at pos, or removed from there if len is
+ * negative, so that typing in a long line does not scan it again. */
+void file_line_shift(struct line *line, size_t pos, long len);
+
+/* Updates the state cached for the line for the characters from pos on being
+ * cut off. */
+void file_line_cut(struct line *line, size_t pos);
 
 #endif /* _FILE_H_ */
@@ -1,4 +1,8 @@
 #include "render.h"
+#include "stats.h"
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
 
 /* Gets the terminal's current termios configuration. */
 struct termios render_termios_get() {
@@ -83,11 +87,17 @@ int render_strlen(char *s, int max_len) {
 }
 
 void render_buffer_append(struct render_buffer *buf, const char *s, int len) {
-  char *new = realloc(buf->buf, buf->len + len);
-  if (new == NULL)
-    return;
-  memcpy(&new[buf->len], s, len);
-  buf->buf = new;
+  if (buf->len + len > buf->cap) {
+    int cap = buf->cap > 0 ? buf->cap : 4096;
+    while (cap < buf->len + len)
+      cap *= 2;
+    char *new = realloc(buf->buf, cap);
+    if (new == NULL)
+      return;
+    buf->buf = new;
+    buf->cap = cap;
+  }
+  memcpy(&buf->buf[buf->len], s, len);
   buf->len += len;
 }
 
@@ -95,11 +105,25 @@ void render_buffer_free(struct render_buffer *buf) {
   free(buf->buf);
   buf->buf = NULL;
   buf->len = 0;
+  buf->cap = 0;
 }
 
-void render_buffer_write(struct render_buffer *buf) {
-  write(STDOUT_FILENO, buf->buf, buf->len);
-  render_buffer_free(buf);
+int render_buffer_write(struct render_buffer *buf) {
+  STATS_RECORD(frame_bytes, buf->len);
+  int written = 0;
+  while (written < buf->len) {
+    STATS_COUNT(writes);
+    ssize_t n = write(STDOUT_FILENO, &buf->buf[written], buf->len - written);
+    if (n == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      buf->len = 0;
+      return -1;
+    }
+    written += n;
+  }
+  buf->len = 0;
+  return 0;
 }
 
 void render_set_cursor_home(struct render_buffer *buf) {
@@ -112,30 +136,424 @@ void render_set_cursor_position(struct render_buffer *buf, int row, int col) {
   render_buffer_append(buf, cursor_pos, len);
 }
 
+void render_set_bracketed_paste(struct render_buffer *buf, int enable) {
+  if (enable)
+    render_buffer_append(buf, "\033[?2004h", 8);
+  else
+    render_buffer_append(buf, "\033[?2004l", 8);
+}
+
 void render_clear_screen(struct render_buffer *buf) {
   render_buffer_append(buf, "\033[2J", 4);
 };
 
-/* Renders the provided row at the current cursor position. */
-void render_row(struct render_buffer *buf, const char *row, int len,
-                int tab_stop) {
-  render_buffer_append(buf, "\033[s\r", 4);
-
-  /* Maximum number of tab stops required */
-  char *rend_buf = malloc(len * tab_stop + 1);
-  int rend_index = 0;
-  for (int i = 0; i < len; i++) {
-    if (row[i] == '\t') {
-      for (int j = 0; j < tab_stop; j++) {
-        rend_buf[rend_index++] = ' ';
+void render_screen_init(struct render_screen *screen, int rows, int cols) {
+  screen->rows = rows;
+  screen->cols = cols;
+  screen->cells = malloc(rows * cols);
+  screen->shown = malloc(rows * cols);
+  screen->dirty = malloc(rows);
+  screen->attrs = malloc(rows * cols);
+  screen->shown_attrs = malloc(rows * cols);
+  memset(screen->cells, ' ', rows * cols);
+  memset(screen->shown, ' ', rows * cols);
+  memset(screen->attrs, RENDER_ATTR_NORMAL, rows * cols);
+  memset(screen->shown_attrs, RENDER_ATTR_NORMAL, rows * cols);
+  memset(screen->dirty, 1, rows);
+  screen->scrolls_len = 0;
+}
+
+void render_screen_free(struct render_screen *screen) {
+  free(screen->cells);
+  free(screen->shown);
+  free(screen->dirty);
+  free(screen->attrs);
+  free(screen->shown_attrs);
+}
+
+void render_screen_touch(struct render_screen *screen, int from, int to) {
+  if (from < 0)
+    from = 0;
+  if (to > screen->rows)
+    to = screen->rows;
+  if (from < to)
+    memset(&screen->dirty[from], 1, to - from);
+}
+
+/* Moves rows top to bottom of the provided grid up by n rows and fills the
+ * uncovered rows with blank. Scrolls down for negative n. */
+static void render_grid_scroll(char *grid, int cols, int top, int bottom,
+                               int n, char blank) {
+  int height = bottom - top + 1;
+  int shift = n > 0 ? n : -n;
+  int kept = height - shift;
+  if (n > 0) {
+    memmove(&grid[top * cols], &grid[(top + shift) * cols], kept * cols);
+    memset(&grid[(top + kept) * cols], blank, shift * cols);
+  } else {
+    memmove(&grid[(top + shift) * cols], &grid[top * cols], kept * cols);
+    memset(&grid[top * cols], blank, shift * cols);
+  }
+}
+
+void render_screen_scroll(struct render_screen *screen, int top, int bottom,
+                          int n) {
+  if (top < 0)
+    top = 0;
+  if (bottom >= screen->rows)
+    bottom = screen->rows - 1;
+
+  int height = bottom - top + 1;
+  if (n == 0 || height <= 0)
+    return;
+
+  /* Scrolling the whole region away is the same as redrawing it. */
+  if (n >= height || -n >= height) {
+    memset(&screen->cells[top * screen->cols], ' ', height * screen->cols);
+    memset(&screen->attrs[top * screen->cols], RENDER_ATTR_NORMAL,
+           height * screen->cols);
+    render_screen_touch(screen, top, bottom + 1);
+    return;
+  }
+
+  render_grid_scroll(screen->cells, screen->cols, top, bottom, n, ' ');
+  render_grid_scroll(screen->attrs, screen->cols, top, bottom, n,
+                     RENDER_ATTR_NORMAL);
+  render_grid_scroll(screen->dirty, 1, top, bottom, n, 1);
+  if (n > 0)
+    render_screen_touch(screen, bottom - n + 1, bottom + 1);
+  else
+    render_screen_touch(screen, top, top - n);
+
+  /* If too many scrolls pile up the rows are simply written out again. */
+  if (screen->scrolls_len < RENDER_MAX_SCROLLS)
+    screen->scrolls[screen->scrolls_len++] = (struct render_scroll){top, bottom,
+                                                                   n};
+}
+
+struct line_render *render_line(struct line *line) {
+  if (line->render)
+    return line->render != &line_render_plain ? line->render : NULL;
+
+  int tabs_len = 0;
+  const char *p = line->chars, *end = line->chars + line->len;
+  while ((p = memchr(p, '\t', end - p)) != NULL) {
+    tabs_len++;
+    p++;
+  }
+  if (tabs_len == 0) {
+    line->render = &line_render_plain;
+    return NULL;
+  }
+
+  /* The tab positions share one allocation with the cache itself. */
+  struct line_render *render =
+      malloc(sizeof(struct line_render) + sizeof(int) * tabs_len);
+  render->tabs = (int *)(render + 1);
+  render->tabs_len = 0;
+  for (p = line->chars; (p = memchr(p, '\t', end - p)) != NULL; p++)
+    render->tabs[render->tabs_len++] = p - line->chars;
+
+  line->render = render;
+  return render;
+}
+
+/* Returns the number of tabs of the line before the provided file column. */
+static int render_tabs_before(struct line_render *render, int col) {
+  int lo = 0, hi = render->tabs_len;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (render->tabs[mid] < col)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Both column conversions binary search the tab positions of the line, since
+ * every other character takes up exactly one cell. */
+int render_line_col(struct line *line, int col, int tab_stop) {
+  struct line_render *render = render_line(line);
+  if (!render)
+    return col;
+  return col + render_tabs_before(render, col) * (tab_stop - 1);
+}
+
+int render_line_file_col(struct line *line, int render_col, int tab_stop) {
+  if (line->len == 0)
+    return 0;
+  if (render_col < 0)
+    render_col = 0;
+
+  int col = render_col;
+  struct line_render *render = render_line(line);
+  if (render) {
+    /* Find the number of tabs displayed before or at render_col. */
+    int lo = 0, hi = render->tabs_len;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (render->tabs[mid] + mid * (tab_stop - 1) <= render_col)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+    int tab = lo - 1;
+    if (tab >= 0 &&
+        render_col < render->tabs[tab] + tab * (tab_stop - 1) + tab_stop)
+      col = render->tabs[tab];
+    else
+      col = render_col - lo * (tab_stop - 1);
+  }
+
+  return col < line->len ? col : line->len - 1;
+}
+
+void render_row(struct render_screen *screen, int row, struct line *line,
+                int col_offset, int tab_stop) {
+  char *cells = &screen->cells[row * screen->cols];
+  int cols = screen->cols, x = 0;
+  if (line && line->len > 0 &&
+      col_offset < render_line_col(line, line->len, tab_stop)) {
+    /* Start from the character shown at col_offset, which is only partly
+     * shown if it is a tab, and expand the tabs up to the end of the row. */
+    struct line_render *render = render_line(line);
+    int col = render_line_file_col(line, col_offset, tab_stop);
+    int tab = render ? render_tabs_before(render, col) : 0;
+    int tabs_len = render ? render->tabs_len : 0;
+    x = render_line_col(line, col, tab_stop) - col_offset;
+    while (x < cols && col < line->len) {
+      int next = tab < tabs_len ? render->tabs[tab] : line->len;
+      int n = next - col < cols - x ? next - col : cols - x;
+      if (n > 0) {
+        memcpy(&cells[x], &line->chars[col], n);
+        x += n;
+        col += n;
+      }
+      if (col == next && tab < tabs_len) {
+        int from = x > 0 ? x : 0;
+        int to = x + tab_stop < cols ? x + tab_stop : cols;
+        memset(&cells[from], ' ', to - from);
+        x += tab_stop;
+        col++;
+        tab++;
       }
-    } else {
-      rend_buf[rend_index++] = row[i];
     }
+    if (x > cols)
+      x = cols;
+  }
+  memset(&cells[x], ' ', cols - x);
+  memset(&screen->attrs[row * cols], RENDER_ATTR_NORMAL, cols);
+  screen->dirty[row] = 0;
+}
+
+void render_row_attr(struct render_screen *screen, int row, int from, int to,
+                     char attr) {
+  if (from < 0)
+    from = 0;
+  if (to > screen->cols)
+    to = screen->cols;
+  if (from < to)
+    memset(&screen->attrs[row * screen->cols + from], attr, to - from);
+}
+
+/* Writes len cells, switching the terminal to the attribute of each run of
+ * cells that are not normal and back to normal after it. */
+static void render_cells_write(struct render_buffer *buf, const char *cells,
+                               const char *attrs, int len) {
+  int start = 0;
+  while (start < len) {
+    int end = start + 1;
+    while (end < len && attrs[end] == attrs[start])
+      end++;
+
+    if (attrs[start] == RENDER_ATTR_MATCH)
+      render_buffer_append(buf, "\033[7m", 4);
+    render_buffer_append(buf, &cells[start], end - start);
+    if (attrs[start] != RENDER_ATTR_NORMAL)
+      render_buffer_append(buf, "\033[m", 3);
+    start = end;
+  }
+}
+
+/* Approximate number of bytes written to move the cursor. */
+#define RENDER_MOVE_COST 8
+
+/* Returns 1 if the cell at x is shown as it is, where a NULL shown stands for
+ * a blank row. */
+static int render_cell_shown(const char *cells, const char *attrs,
+                             const char *shown, const char *shown_attrs,
+                             int x) {
+  if (!shown)
+    return cells[x] == ' ' && attrs[x] == RENDER_ATTR_NORMAL;
+  return cells[x] == shown[x] && attrs[x] == shown_attrs[x];
+}
+
+/* Returns 1 if a terminal row showing shown, or a blank row if shown is NULL,
+ * has to be written to show the provided cells. */
+static int render_row_changed(const char *cells, const char *attrs,
+                              const char *shown, const char *shown_attrs,
+                              int cols) {
+  if (shown)
+    return memcmp(cells, shown, cols) != 0 ||
+           memcmp(attrs, shown_attrs, cols) != 0;
+  for (int x = 0; x < cols; x++)
+    if (!render_cell_shown(cells, attrs, shown, shown_attrs, x))
+      return 1;
+  return 0;
+}
+
+/* Returns 1 if none of the cells hold a byte of a UTF-8 character, so that
+ * each cell is shown in a terminal column of its own. */
+static int render_cells_ascii(const char *cells, int len) {
+  unsigned char high = 0;
+  for (int x = 0; x < len; x++)
+    high |= cells[x];
+  return high < 0x80;
+}
+
+/* Finds the part of a row of cells that has to be written for the terminal to
+ * show it instead of shown, or instead of a blank row if shown is NULL: the
+ * cells from *first up to *end, followed by an erase of the rest of the row if
+ * *erase is set. Returns 0 if the row does not have to be written. */
+static int render_row_span(const char *cells, const char *attrs,
+                           const char *shown, const char *shown_attrs,
+                           int cols, int *first, int *end, int *erase) {
+  if (!render_row_changed(cells, attrs, shown, shown_attrs, cols))
+    return 0;
+
+  /* Cells past a UTF-8 character are shown in other terminal columns than
+   * their own, so a row that holds or held one is written again whole and
+   * the terminal lays it out. */
+  if (!render_cells_ascii(cells, cols) ||
+      (shown && !render_cells_ascii(shown, cols))) {
+    *first = 0;
+    *end = cols;
+    while (*end > 0 && cells[*end - 1] == ' ' &&
+           attrs[*end - 1] == RENDER_ATTR_NORMAL)
+      (*end)--;
+    *erase = 1;
+    return 1;
+  }
+
+  *first = 0;
+  while (render_cell_shown(cells, attrs, shown, shown_attrs, *first))
+    (*first)++;
+  int last = cols - 1;
+  while (render_cell_shown(cells, attrs, shown, shown_attrs, last))
+    last--;
+
+  /* Trailing blanks are cleared with a single erase instead of being
+   * written out. */
+  *end = cols;
+  while (*end > *first && cells[*end - 1] == ' ' &&
+         attrs[*end - 1] == RENDER_ATTR_NORMAL)
+    (*end)--;
+  *erase = last >= *end;
+  if (!*erase)
+    *end = last + 1;
+  return 1;
+}
+
+/* Returns the approximate number of bytes written to update rows top to
+ * bottom of the terminal if the rows it shows were first moved up by n rows,
+ * or down if n is negative. Only the rows that changed are counted, at the
+ * cost of a cursor move each, if exact is 0. Counting stops once the cost
+ * exceeds limit. */
+static int render_rows_cost(struct render_screen *screen, int top, int bottom,
+                            int n, int exact, int limit) {
+  int cols = screen->cols, cost = 0;
+  for (int row = top; row <= bottom && cost <= limit; row++) {
+    int from = row + n, first, end, erase;
+    int in = from >= top && from <= bottom;
+    const char *cells = &screen->cells[row * cols];
+    const char *attrs = &screen->attrs[row * cols];
+    const char *shown = in ? &screen->shown[from * cols] : NULL;
+    const char *shown_attrs = in ? &screen->shown_attrs[from * cols] : NULL;
+    if (!exact)
+      cost += RENDER_MOVE_COST *
+              render_row_changed(cells, attrs, shown, shown_attrs, cols);
+    else if (render_row_span(cells, attrs, shown, shown_attrs, cols, &first,
+                             &end, &erase))
+      cost += RENDER_MOVE_COST + end - first + (erase ? 3 : 0);
+  }
+  return cost;
+}
+
+/* Replays a scroll on the terminal using a scroll region, so the rows that
+ * moved keep their contents. The scroll is skipped when writing the rows
+ * again costs less, such as when most of them changed anyway or only differ
+ * in a few cells. */
+static void render_scroll_write(struct render_screen *screen,
+                                struct render_buffer *buf,
+                                struct render_scroll *scroll) {
+  int shift = scroll->n > 0 ? scroll->n : -scroll->n;
+  int cost = 3 * RENDER_MOVE_COST + 2 * shift +
+             render_rows_cost(screen, scroll->top, scroll->bottom, scroll->n,
+                              1, INT_MAX);
+  /* Counting the changed rows is usually enough to tell that the scroll is
+   * cheaper, without finding what changed in each. */
+  if (render_rows_cost(screen, scroll->top, scroll->bottom, 0, 0, cost) <=
+          cost &&
+      render_rows_cost(screen, scroll->top, scroll->bottom, 0, 1, cost) <= cost)
+    return;
+
+  char term_command[32];
+  int len = snprintf(term_command, sizeof(term_command), "\033[%d;%dr",
+                     scroll->top + 1, scroll->bottom + 1);
+  render_buffer_append(buf, term_command, len);
+
+  if (scroll->n > 0) {
+    render_set_cursor_position(buf, scroll->bottom + 1, 1);
+    for (int i = 0; i < scroll->n; i++)
+      render_buffer_append(buf, "\033D", 2);
+  } else {
+    render_set_cursor_position(buf, scroll->top + 1, 1);
+    for (int i = 0; i < -scroll->n; i++)
+      render_buffer_append(buf, "\033M", 2);
   }
-  rend_buf[rend_index + 1] = '\0';
-  render_buffer_append(buf, rend_buf, rend_index);
-  render_buffer_append(buf, "\033[K", 3);
-  render_buffer_append(buf, "\033[u", 3);
-  free(rend_buf);
+
+  render_buffer_append(buf, "\033[r", 3);
+  render_grid_scroll(screen->shown, screen->cols, scroll->top, scroll->bottom,
+                     scroll->n, ' ');
+  render_grid_scroll(screen->shown_attrs, screen->cols, scroll->top,
+                     scroll->bottom, scroll->n, RENDER_ATTR_NORMAL);
+}
+
+void render_screen_flush(struct render_screen *screen,
+                         struct render_buffer *buf, int cursor_row,
+                         int cursor_col) {
+  for (int i = 0; i < screen->scrolls_len; i++)
+    render_scroll_write(screen, buf, &screen->scrolls[i]);
+  screen->scrolls_len = 0;
+
+  /* Terminal cursor position, -1 when unknown. */
+  int term_row = -1, term_col = -1;
+  int cols = screen->cols;
+
+  for (int row = 0; row < screen->rows; row++) {
+    char *cells = &screen->cells[row * cols];
+    char *shown = &screen->shown[row * cols];
+    char *attrs = &screen->attrs[row * cols];
+    char *shown_attrs = &screen->shown_attrs[row * cols];
+    int first, end, erase;
+    if (!render_row_span(cells, attrs, shown, shown_attrs, cols, &first, &end,
+                         &erase))
+      continue;
+
+    if (term_row != row || term_col != first)
+      render_set_cursor_position(buf, row + 1, first + 1);
+    render_cells_write(buf, &cells[first], &attrs[first], end - first);
+    if (erase)
+      render_buffer_append(buf, "\033[K", 3);
+
+    term_row = row;
+    term_col = end < cols && render_cells_ascii(cells, end) ? end : -1;
+    memcpy(shown, cells, cols);
+    memcpy(shown_attrs, attrs, cols);
+  }
+
+  if (term_row != cursor_row || term_col != cursor_col)
+    render_set_cursor_position(buf, cursor_row + 1, cursor_col + 1);
 }
@@ -1,6 +1,7 @@
 #ifndef _RENDER_H_
 #define _RENDER_H_
 
+#include "file.h"
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,9 +10,58 @@
 #include <termios.h>
 #include <unistd.h>
 
+/* Sequences the terminal surrounds pasted text with in bracketed paste mode,
+ * after the escape character. */
+#define RENDER_PASTE_START "[200~"
+#define RENDER_PASTE_END "[201~"
+
+/* Output buffer for a frame. The memory is kept between frames so that
+ * rendering does not allocate once the buffer has grown to fit a frame. */
 struct render_buffer {
   char *buf;
   int len;
+  int cap;
+};
+
+/* Maximum number of scrolls remembered between two flushes. */
+#define RENDER_MAX_SCROLLS 16
+
+/* Rows top to bottom of the screen moved up by n rows, or down if n is
+ * negative. */
+struct render_scroll {
+  int top;
+  int bottom;
+  int n;
+};
+
+/* Cell attributes. */
+#define RENDER_ATTR_NORMAL 0
+#define RENDER_ATTR_MATCH 1
+
+/* Virtual screen. Rows are drawn into cells and only the cells that differ
+ * from what the terminal shows are written out on flush. */
+struct render_screen {
+  int rows;
+  int cols;
+
+  /* Contents of the next frame, rows * cols characters. */
+  char *cells;
+
+  /* Contents the terminal is currently showing. */
+  char *shown;
+
+  /* Attribute of each cell of the next frame and of what the terminal is
+   * showing, one of the RENDER_ATTR values. */
+  char *attrs;
+  char *shown_attrs;
+
+  /* Rows whose contents have changed and need to be drawn again. */
+  char *dirty;
+
+  /* Scrolls applied to cells since the last flush. They are replayed on the
+   * terminal so rows that only moved are not written again. */
+  struct render_scroll scrolls[RENDER_MAX_SCROLLS];
+  int scrolls_len;
 };
 
 /* Gets the terminal's current termios configuration. */
@@ -27,25 +77,75 @@ void render_termios_enable_raw_mode(struct termios *termios);
  * unsuccessful. */
 int render_get_window_size(int *rows, int *cols);
 
-/* Writes the contents of the provided buffer to the terminal. */
-void render_buffer_write(struct render_buffer *buf);
+/* Writes the contents of the provided buffer to the terminal and empties it.
+ * Returns -1 if the terminal could not be written to. */
+int render_buffer_write(struct render_buffer *buf);
 
 /* Appends the first len characters from the provided string to the provided
  * buffer. */
 void render_buffer_append(struct render_buffer *buf, const char *s, int len);
 
-/* Frees the memory allocated for the provided buffer and sets the length to
- * zero. */
+/* Frees the memory allocated for the provided buffer and sets the length and
+ * capacity to zero. */
 void render_buffer_free(struct render_buffer *buf);
 
 /* Sets the cursor position to the top left corner. */
 void render_set_cursor_home(struct render_buffer *buf);
 
+/* Turns bracketed paste mode on or off. While it is on the terminal wraps
+ * pasted text in RENDER_PASTE_START and RENDER_PASTE_END. */
+void render_set_bracketed_paste(struct render_buffer *buf, int enable);
+
 /* Clears the terminal screen */
 void render_clear_screen(struct render_buffer *buf);
 
-/* Renders the provided row at the current cursor position. */
-void render_row(struct render_buffer *buf, const char *row, int len, int tab_stop);
+/* Allocates a blank virtual screen of the provided size with every row marked
+ * as dirty. */
+void render_screen_init(struct render_screen *screen, int rows, int cols);
+
+/* Frees the memory allocated for the provided screen. */
+void render_screen_free(struct render_screen *screen);
+
+/* Marks the rows from up to, but not including, to as dirty. Rows outside the
+ * screen are ignored. */
+void render_screen_touch(struct render_screen *screen, int from, int to);
+
+/* Moves rows top to bottom up by n rows, or down if n is negative. The rows
+ * that are uncovered are blanked and marked as dirty. */
+void render_screen_scroll(struct render_screen *screen, int top, int bottom,
+                          int n);
+
+/* Returns the tab positions of the provided line, finding and caching them on
+ * the line if needed. Returns NULL for lines without tabs, which are displayed
+ * as they are. */
+struct line_render *render_line(struct line *line);
+
+/* Returns the display column where the provided file column of the line
+ * starts. Columns past the end of the line are counted as single cells. */
+int render_line_col(struct line *line, int col, int tab_stop);
+
+/* Returns the file column of the character of the line that is displayed at
+ * the provided display column, or the last character if the line is shorter.
+ * Returns 0 for empty lines. */
+int render_line_file_col(struct line *line, int render_col, int tab_stop);
+
+/* Renders the provided line into the provided row of the screen, starting at
+ * display column col_offset and clipped to the screen width, so the cost does
+ * not depend on the length of the line. Renders an empty row if line is
+ * NULL. */
+void render_row(struct render_screen *screen, int row, struct line *line,
+                int col_offset, int tab_stop);
+
+/* Sets the attribute of the cells of the provided row from display column
+ * from up to, but not including, to. Rendering the row resets them. */
+void render_row_attr(struct render_screen *screen, int row, int from, int to,
+                     char attr);
+
+/* Writes the changes since the last flush to the provided buffer and places
+ * the cursor at the provided row and column. Position index starts at 0. */
+void render_screen_flush(struct render_screen *screen,
+                         struct render_buffer *buf, int cursor_row,
+                         int cursor_col);
 
 /* Sets the terminal cursor to the provided row and column. Position index
  * starts at 1. */
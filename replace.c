@@ -0,0 +1,197 @@
+#include "replace.h"
+#include "edit.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Number of rows matched by a thread at a time. */
+#define REPLACE_CHUNK 8192
+
+/* Maximum number of threads matching rows. */
+#define REPLACE_THREADS 32
+
+/* New contents of a row. */
+struct replace_change {
+  size_t row;
+  char *chars;
+  size_t len;
+};
+
+/* Changes found in a chunk of rows, in order. */
+struct replace_chunk {
+  struct replace_change *changes;
+  size_t len;
+  size_t cap;
+  size_t count;
+};
+
+struct replace_job {
+  struct file *f;
+  struct search *s;
+  const char *with;
+  size_t with_len;
+  int all;
+  size_t from;
+  size_t to;
+
+  struct replace_chunk *chunks;
+  size_t chunks_len;
+
+  /* Next chunk to match. Guarded by lock. */
+  pthread_mutex_t lock;
+  size_t next;
+};
+
+/* Returns a copy of the line with the matches replaced, or NULL if it has
+ * none. Matches whose replacement would make the line longer than
+ * LINE_LEN_MAX are left. Stores the length of the copy in *len and adds the
+ * number of matches replaced to *count. */
+static char *replace_line(struct replace_job *job, struct line *line,
+                          size_t *len, size_t *count) {
+  long at = search_line(job->s, line, 0);
+  if (at < 0)
+    return NULL;
+
+  size_t cap = line->len + job->with_len + 1;
+  char *chars = malloc(cap);
+  size_t done = 0, replaced = 0;
+  *len = 0;
+  do {
+    size_t total = *len + (at - done) + job->with_len +
+                   (line->len - at - job->s->len);
+    if (total > LINE_LEN_MAX)
+      break;
+    size_t need = *len + (at - done) + job->with_len + (line->len - at) + 1;
+    if (need > cap) {
+      while (cap < need)
+        cap *= 2;
+      chars = realloc(chars, cap);
+    }
+    memcpy(chars + *len, line->chars + done, at - done);
+    *len += at - done;
+    memcpy(chars + *len, job->with, job->with_len);
+    *len += job->with_len;
+    done = at + job->s->len;
+    replaced++;
+  } while (job->all && (at = search_line(job->s, line, done)) >= 0);
+
+  if (replaced == 0) {
+    free(chars);
+    return NULL;
+  }
+  *count += replaced;
+
+  memcpy(chars + *len, line->chars + done, line->len - done);
+  *len += line->len - done;
+  chars[*len] = '\0';
+  return chars;
+}
+
+static void replace_chunk(struct replace_job *job, size_t i) {
+  struct replace_chunk *chunk = &job->chunks[i];
+  size_t from = job->from + i * REPLACE_CHUNK;
+  size_t to = from + REPLACE_CHUNK < job->to ? from + REPLACE_CHUNK : job->to;
+
+  /* Rows are read a leaf at a time. */
+  struct line *lines = NULL;
+  size_t n = 0;
+  for (size_t row = from; row < to; row++, lines++, n--) {
+    if (n == 0)
+      lines = file_lines(job->f, row, &n);
+
+    size_t len;
+    char *chars = replace_line(job, lines, &len, &chunk->count);
+    if (!chars)
+      continue;
+
+    if (chunk->len == chunk->cap) {
+      chunk->cap = chunk->cap ? chunk->cap * 2 : 64;
+      chunk->changes = realloc(chunk->changes,
+                               sizeof(struct replace_change) * chunk->cap);
+    }
+    chunk->changes[chunk->len++] = (struct replace_change){row, chars, len};
+  }
+}
+
+/* Matches chunks until none are left. The file is only read, so any number of
+ * threads can run this at once. */
+static void *replace_thread(void *arg) {
+  struct replace_job *job = arg;
+  while (1) {
+    pthread_mutex_lock(&job->lock);
+    size_t i = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if (i >= job->chunks_len)
+      return NULL;
+    replace_chunk(job, i);
+  }
+}
+
+size_t replace_rows(struct file *f, struct search *s, const char *with,
+                    size_t with_len, size_t from, size_t to, int all,
+                    size_t *count, struct line **old, size_t **old_rows) {
+  *count = 0;
+  if (s->len == 0 || from >= to)
+    return 0;
+
+  struct replace_job job = {f, s, with, with_len, all, from, to};
+  job.chunks_len = (to - from + REPLACE_CHUNK - 1) / REPLACE_CHUNK;
+  job.chunks = calloc(job.chunks_len, sizeof(struct replace_chunk));
+  pthread_mutex_init(&job.lock, NULL);
+
+  /* The calling thread matches chunks as well, so the work still gets done if
+   * no thread can be started. */
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t threads = cpus > 1 ? cpus : 1;
+  if (threads > REPLACE_THREADS)
+    threads = REPLACE_THREADS;
+  if (threads > job.chunks_len)
+    threads = job.chunks_len;
+
+  pthread_t workers[REPLACE_THREADS];
+  size_t started = 0;
+  while (started + 1 < threads &&
+         pthread_create(&workers[started], NULL, replace_thread, &job) == 0)
+    started++;
+  replace_thread(&job);
+  for (size_t i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+  pthread_mutex_destroy(&job.lock);
+
+  size_t changes = 0;
+  for (size_t i = 0; i < job.chunks_len; i++)
+    changes += job.chunks[i].len;
+  if (old) {
+    *old = malloc(sizeof(struct line) * changes);
+    *old_rows = malloc(sizeof(size_t) * changes);
+  }
+
+  /* The changes are in order, so they are applied a leaf at a time too. */
+  size_t rows = 0, first = 0, n = 0;
+  struct line *lines = NULL;
+  for (size_t i = 0; i < job.chunks_len; i++) {
+    struct replace_chunk *chunk = &job.chunks[i];
+    for (size_t j = 0; j < chunk->len; j++) {
+      struct replace_change *change = &chunk->changes[j];
+      if (change->row >= first + n) {
+        first = change->row;
+        lines = file_lines(f, first, &n);
+      }
+      struct line *line = &lines[change->row - first];
+      if (old) {
+        /* The line gives up its characters instead of freeing them. */
+        (*old)[rows + j] = (struct line){line->chars, line->len, line->cap,
+                                         NULL};
+        (*old_rows)[rows + j] = change->row;
+        line->cap = 0;
+      }
+      edit_set_string(line, change->chars, change->len, change->len + 1);
+    }
+    rows += chunk->len;
+    *count += chunk->count;
+    free(chunk->changes);
+  }
+  free(job.chunks);
+  return rows;
+}
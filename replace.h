@@ -0,0 +1,22 @@
+#ifndef _REPLACE_H_
+#define _REPLACE_H_
+
+#include "file.h"
+#include "search.h"
+
+/* Replaces the matches of the search in the rows from up to, but not
+ * including, to with the first with_len characters of with. Only the first
+ * match of each row is replaced unless all is set, and matches that would
+ * make a row longer than LINE_LEN_MAX are left. The rows are split into
+ * chunks matched on a pool of threads, and the changed rows are updated
+ * together once every chunk is done. Stores the number of matches replaced
+ * in *count and returns the number of rows changed.
+ *
+ * Unless old is NULL, the previous lines of the changed rows are kept instead
+ * of freed, in an array stored in *old, with the rows they were on in
+ * *old_rows. Both arrays are allocated with malloc. */
+size_t replace_rows(struct file *f, struct search *s, const char *with,
+                    size_t with_len, size_t from, size_t to, int all,
+                    size_t *count, struct line **old, size_t **old_rows);
+
+#endif /* _REPLACE_H_ */
@@ -0,0 +1,179 @@
+#include "search.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__TINYC__)
+#include <immintrin.h>
+#define SEARCH_X86 1
+#endif
+
+/* What is known about a block of rows. */
+#define SEARCH_UNKNOWN 0
+#define SEARCH_EMPTY 1
+#define SEARCH_FOUND 2
+
+void search_set(struct search *s, const char *pattern, size_t len) {
+  free(s->pattern);
+  s->pattern = malloc(len + 1);
+  memcpy(s->pattern, pattern, len);
+  s->pattern[len] = '\0';
+  s->len = len;
+
+  for (int c = 0; c < 256; c++)
+    s->shift[c] = len;
+  for (size_t i = 0; i + 1 < len; i++)
+    s->shift[(unsigned char)pattern[i]] = len - 1 - i;
+  search_forget_all(s);
+}
+
+void search_free(struct search *s) {
+  free(s->pattern);
+  free(s->blocks);
+  s->pattern = NULL;
+  s->len = 0;
+  s->blocks = NULL;
+  s->blocks_len = 0;
+}
+
+static long search_horspool(struct search *s, const char *p, size_t len) {
+  size_t m = s->len;
+  const unsigned char *t = (const unsigned char *)p;
+  for (size_t i = 0; i + m <= len; i += s->shift[t[i + m - 1]]) {
+    if (p[i + m - 1] == s->pattern[m - 1] &&
+        memcmp(p + i, s->pattern, m - 1) == 0)
+      return i;
+  }
+  return -1;
+}
+
+#ifdef SEARCH_X86
+/* Compares the first and last characters of the pattern against 16 positions
+ * at once and only checks the rest of it where both match. */
+static long search_sse2(struct search *s, const char *p, size_t len) {
+  size_t m = s->len, i = 0;
+  const __m128i first = _mm_set1_epi8(s->pattern[0]);
+  const __m128i last = _mm_set1_epi8(s->pattern[m - 1]);
+  for (; i + m - 1 + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + i + m - 1));
+    unsigned mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    for (; mask; mask &= mask - 1) {
+      size_t at = i + __builtin_ctz(mask);
+      if (memcmp(p + at, s->pattern, m) == 0)
+        return at;
+    }
+  }
+
+  long at = search_horspool(s, p + i, len - i);
+  return at < 0 ? -1 : (long)i + at;
+}
+#endif
+
+long search_line(struct search *s, struct line *line, size_t from) {
+  if (s->len == 0 || from > line->len)
+    return -1;
+
+#ifdef SEARCH_X86
+  long at = search_sse2(s, line->chars + from, line->len - from);
+#else
+  long at = search_horspool(s, line->chars + from, line->len - from);
+#endif
+  return at < 0 ? -1 : (long)from + at;
+}
+
+/* Returns the column of the last match in the line starting before the
+ * provided column, or -1 if there is none. */
+static long search_line_before(struct search *s, struct line *line,
+                               size_t before) {
+  long last = -1;
+  for (long at = search_line(s, line, 0); at >= 0 && (size_t)at < before;
+       at = search_line(s, line, at + 1))
+    last = at;
+  return last;
+}
+
+/* Returns what is known about the provided block of rows, scanning it if
+ * nothing is known yet. */
+static int search_block(struct search *s, struct file *f, size_t block) {
+  if (block >= s->blocks_len) {
+    size_t len = block + 1 > s->blocks_len * 2 ? block + 1 : s->blocks_len * 2;
+    s->blocks = realloc(s->blocks, len);
+    memset(s->blocks + s->blocks_len, SEARCH_UNKNOWN, len - s->blocks_len);
+    s->blocks_len = len;
+  }
+
+  if (s->blocks[block] == SEARCH_UNKNOWN) {
+    size_t end = (block + 1) * SEARCH_BLOCK;
+    if (end > f->len)
+      end = f->len;
+    s->blocks[block] = SEARCH_EMPTY;
+    struct line *lines = NULL;
+    size_t n = 0;
+    for (size_t row = block * SEARCH_BLOCK; row < end; row++, lines++, n--) {
+      if (n == 0)
+        lines = file_lines(f, row, &n);
+      if (search_line(s, lines, 0) >= 0) {
+        s->blocks[block] = SEARCH_FOUND;
+        break;
+      }
+    }
+  }
+  return s->blocks[block];
+}
+
+int search_file(struct search *s, struct file *f, int forward, size_t *row,
+                size_t *col) {
+  if (s->len == 0 || f->len == 0)
+    return 0;
+
+  size_t len = f->len, r = *row;
+  long at = forward ? search_line(s, file_line(f, r), *col + 1)
+                    : search_line_before(s, file_line(f, r), *col);
+
+  /* The other rows are visited in order, ending with the starting row again
+   * for the matches on its other side. Blocks without matches are skipped
+   * whole. */
+  for (size_t n = 0; at < 0 && n < len; n++) {
+    if (forward) {
+      r = r + 1 == len ? 0 : r + 1;
+      if (r % SEARCH_BLOCK == 0 &&
+          search_block(s, f, r / SEARCH_BLOCK) == SEARCH_EMPTY) {
+        size_t skip = len - r < SEARCH_BLOCK ? len - r : SEARCH_BLOCK;
+        r += skip - 1;
+        n += skip - 1;
+        continue;
+      }
+      at = search_line(s, file_line(f, r), 0);
+    } else {
+      r = r == 0 ? len - 1 : r - 1;
+      if ((r % SEARCH_BLOCK == SEARCH_BLOCK - 1 || r == len - 1) &&
+          search_block(s, f, r / SEARCH_BLOCK) == SEARCH_EMPTY) {
+        size_t skip = r % SEARCH_BLOCK;
+        r -= skip;
+        n += skip;
+        continue;
+      }
+      at = search_line_before(s, file_line(f, r), SIZE_MAX);
+    }
+  }
+
+  if (at < 0)
+    return 0;
+  *row = r;
+  *col = at;
+  return 1;
+}
+
+void search_forget(struct search *s, size_t from, size_t to) {
+  for (size_t block = from / SEARCH_BLOCK;
+       from < to && block <= (to - 1) / SEARCH_BLOCK && block < s->blocks_len;
+       block++)
+    s->blocks[block] = SEARCH_UNKNOWN;
+}
+
+void search_forget_all(struct search *s) {
+  if (s->blocks)
+    memset(s->blocks, SEARCH_UNKNOWN, s->blocks_len);
+}
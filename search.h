@@ -0,0 +1,48 @@
+#ifndef _SEARCH_H_
+#define _SEARCH_H_
+
+#include "file.h"
+
+/* Number of rows whose matches are remembered together. */
+#define SEARCH_BLOCK 4096
+
+/* Pattern searched for in a file. Blocks of rows found to have no match are
+ * remembered, so repeated searches skip them until they change. */
+struct search {
+  char *pattern;
+  size_t len;
+
+  /* Distance to shift the pattern by for each byte under its last character,
+   * for Boyer-Moore-Horspool matching. */
+  size_t shift[256];
+
+  /* What is known about each block of SEARCH_BLOCK rows. */
+  unsigned char *blocks;
+  size_t blocks_len;
+};
+
+/* Sets the pattern searched for and forgets what was known about the old
+ * one. An empty pattern matches nothing. */
+void search_set(struct search *s, const char *pattern, size_t len);
+
+void search_free(struct search *s);
+
+/* Returns the column of the first match in the line starting at or after
+ * from, or -1 if there is none. */
+long search_line(struct search *s, struct line *line, size_t from);
+
+/* Finds the closest match after the provided position, or before it if
+ * forward is 0, wrapping around the end of the file. Stores its position in
+ * *row and *col and returns 1 if there is one. */
+int search_file(struct search *s, struct file *f, int forward, size_t *row,
+                size_t *col);
+
+/* Forgets what was known about the rows from up to, but not including, to.
+ * Must be called whenever rows change. */
+void search_forget(struct search *s, size_t from, size_t to);
+
+/* Forgets what was known about every row. Must be called whenever rows are
+ * inserted or deleted. */
+void search_forget_all(struct search *s);
+
+#endif /* _SEARCH_H_ */
@@ -0,0 +1,114 @@
+#include "split.h"
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__TINYC__)
+#include <immintrin.h>
+#define SPLIT_X86 1
+#endif
+
+static const char *split_find_eol_scalar(const char *p, const char *end) {
+  while (p < end && *p != '\n' && *p != '\r')
+    p++;
+  return p;
+}
+
+static const char *split_skip_lines_scalar(const char *p, const char *end,
+                                           size_t *n) {
+  while (*n > 0) {
+    const char *nl = memchr(p, '\n', end - p);
+    if (!nl)
+      return end;
+    p = nl + 1;
+    (*n)--;
+  }
+  return p;
+}
+
+#ifdef SPLIT_X86
+/* Returns the position after the nth '\n' in the block of bytes from p whose
+ * newlines are set in mask. */
+static const char *split_nth(const char *p, unsigned mask, size_t n) {
+  while (--n > 0)
+    mask &= mask - 1;
+  return p + __builtin_ctz(mask) + 1;
+}
+
+static const char *split_find_eol_sse2(const char *p, const char *end) {
+  const __m128i lf = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    unsigned mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+  return split_find_eol_scalar(p, end);
+}
+
+static const char *split_skip_lines_sse2(const char *p, const char *end,
+                                         size_t *n) {
+  const __m128i lf = _mm_set1_epi8('\n');
+  for (; *n > 0 && end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+    size_t count = __builtin_popcount(mask);
+    if (count >= *n) {
+      p = split_nth(p, mask, *n);
+      *n = 0;
+      return p;
+    }
+    *n -= count;
+  }
+  return split_skip_lines_scalar(p, end, n);
+}
+
+__attribute__((target("avx2"))) static const char *
+split_find_eol_avx2(const char *p, const char *end) {
+  const __m256i lf = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r');
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    unsigned mask = _mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, cr)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+  return split_find_eol_sse2(p, end);
+}
+
+__attribute__((target("avx2,popcnt"))) static const char *
+split_skip_lines_avx2(const char *p, const char *end, size_t *n) {
+  const __m256i lf = _mm256_set1_epi8('\n');
+  for (; *n > 0 && end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+    size_t count = __builtin_popcount(mask);
+    if (count >= *n) {
+      p = split_nth(p, mask, *n);
+      *n = 0;
+      return p;
+    }
+    *n -= count;
+  }
+  return split_skip_lines_sse2(p, end, n);
+}
+#endif
+
+const char *split_find_eol(const char *p, const char *end) {
+#ifdef SPLIT_X86
+  if (__builtin_cpu_supports("avx2"))
+    return split_find_eol_avx2(p, end);
+  return split_find_eol_sse2(p, end);
+#else
+  return split_find_eol_scalar(p, end);
+#endif
+}
+
+const char *split_skip_lines(const char *p, const char *end, size_t *n) {
+#ifdef SPLIT_X86
+  if (__builtin_cpu_supports("avx2"))
+    return split_skip_lines_avx2(p, end, n);
+  return split_skip_lines_sse2(p, end, n);
+#else
+  return split_skip_lines_scalar(p, end, n);
+#endif
+}
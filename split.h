@@ -0,0 +1,19 @@
+#ifndef _SPLIT_H_
+#define _SPLIT_H_
+
+#include <stddef.h>
+
+/* Line splitting primitives. They scan 16 or 32 bytes at a time with SSE2 or
+ * AVX2 when the compiler and CPU support them, and a byte at a time
+ * otherwise. */
+
+/* Returns the first '\n' or '\r' between p and end, or end if there is
+ * none. */
+const char *split_find_eol(const char *p, const char *end);
+
+/* Skips up to *n lines from p, subtracting the number of '\n' passed from *n.
+ * Returns the position after the last '\n' passed, or end if there were fewer
+ * than *n. */
+const char *split_skip_lines(const char *p, const char *end, size_t *n);
+
+#endif /* _SPLIT_H_ */
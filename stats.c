@@ -0,0 +1,139 @@
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct stats stats;
+
+uint64_t stats_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_record(struct stats_histogram *h, uint64_t value) {
+  int bucket = 0;
+  while (bucket < STATS_BUCKETS - 1 && value >= (uint64_t)1 << bucket)
+    bucket++;
+
+  h->buckets[bucket]++;
+  h->count++;
+  h->sum += value;
+  if (value > h->max)
+    h->max = value;
+}
+
+/* Returns the upper bound of the bucket holding the pth fraction of the
+ * values, or the largest value if it is lower. */
+static uint64_t stats_percentile(struct stats_histogram *h, double p) {
+  uint64_t target = h->count * p, seen = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen > target) {
+      uint64_t bound = (uint64_t)1 << i;
+      return bound < h->max ? bound : h->max;
+    }
+  }
+  return h->max;
+}
+
+/* Formats a duration in ns with a readable unit. */
+static void stats_format_ns(char *buf, size_t size, uint64_t ns) {
+  if (ns < 1000)
+    snprintf(buf, size, "%lluns", (unsigned long long)ns);
+  else if (ns < 1000000)
+    snprintf(buf, size, "%.1fus", ns / 1e3);
+  else if (ns < 1000000000)
+    snprintf(buf, size, "%.1fms", ns / 1e6);
+  else
+    snprintf(buf, size, "%.1fs", ns / 1e9);
+}
+
+static void stats_write_time(FILE *fp, const char *name,
+                             struct stats_histogram *h) {
+  char p50[16], p99[16], max[16];
+  stats_format_ns(p50, sizeof(p50), stats_percentile(h, 0.5));
+  stats_format_ns(p99, sizeof(p99), stats_percentile(h, 0.99));
+  stats_format_ns(max, sizeof(max), h->max);
+  fprintf(fp, "%-12s %10llu  p50 %-8s p99 %-8s max %s\n", name,
+          (unsigned long long)h->count, p50, p99, max);
+}
+
+static void stats_write_size(FILE *fp, const char *name,
+                             struct stats_histogram *h) {
+  fprintf(fp, "%-12s %10llu  p50 %-8llu p99 %-8llu max %-8llu total %llu\n",
+          name, (unsigned long long)h->count,
+          (unsigned long long)stats_percentile(h, 0.5),
+          (unsigned long long)stats_percentile(h, 0.99),
+          (unsigned long long)h->max, (unsigned long long)h->sum);
+}
+
+static void stats_write_count(FILE *fp, const char *name, uint64_t count) {
+  fprintf(fp, "%-12s %10llu\n", name, (unsigned long long)count);
+}
+
+static void stats_write(FILE *fp) {
+  stats_write_time(fp, "keys", &stats.key_ns);
+  stats_write_time(fp, "frames", &stats.frame_ns);
+  stats_write_size(fp, "frame bytes", &stats.frame_bytes);
+  stats_write_count(fp, "writes", stats.writes);
+  stats_write_time(fp, "file open", &stats.open_ns);
+  stats_write_time(fp, "file save", &stats.save_ns);
+  stats_write_count(fp, "edits", stats.edits);
+  if (STATS) {
+    stats_write_count(fp, "mallocs", stats.mallocs);
+    stats_write_count(fp, "reallocs", stats.reallocs);
+  }
+}
+
+int stats_report(char *buf, size_t size) {
+  /* The last byte is kept for the terminating NUL in case the report does
+   * not fit. */
+  buf[size - 1] = '\0';
+  FILE *fp = fmemopen(buf, size - 1, "w");
+  if (!fp)
+    return 0;
+  stats_write(fp);
+  fclose(fp);
+
+  /* Drop the newline after the last line. */
+  int len = strlen(buf);
+  if (len > 0 && buf[len - 1] == '\n')
+    buf[--len] = '\0';
+  return len;
+}
+
+int stats_dump(const char *path) {
+  FILE *fp = fopen(path, "w");
+  if (!fp)
+    return -1;
+  stats_write(fp);
+  return fclose(fp) == 0 ? 0 : -1;
+}
+
+#if STATS && defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) &&           \
+    !defined(__SANITIZE_THREAD__)
+/* The allocator is counted by defining malloc, calloc and realloc here, which
+ * takes precedence over the C library, and passing the calls on to glibc's own
+ * implementation. Sanitizers replace the allocator themselves, so it is left
+ * alone when they are on. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) {
+  __atomic_fetch_add(&stats.mallocs, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  __atomic_fetch_add(&stats.mallocs, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+  __atomic_fetch_add(&stats.reallocs, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(p, size);
+}
+#endif
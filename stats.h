@@ -0,0 +1,79 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Counters and latency histograms for the hot paths of the editor. They cost
+ * a clock read per key and frame, so they are always kept. Allocations are
+ * only counted when built with -DSTATS=1, as vip-bench is, since that replaces
+ * the allocator. */
+#ifndef STATS
+#define STATS 0
+#endif
+
+/* Number of buckets in a histogram. Bucket i counts the values below 2^i that
+ * do not fit in a lower bucket. */
+#define STATS_BUCKETS 40
+
+struct stats_histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[STATS_BUCKETS];
+};
+
+struct stats {
+  /* Time to handle a key, from reading it to being done with it, in ns. */
+  struct stats_histogram key_ns;
+
+  /* Time to draw a frame and write it to the terminal, in ns. */
+  struct stats_histogram frame_ns;
+
+  /* Bytes written to the terminal per frame. */
+  struct stats_histogram frame_bytes;
+
+  /* Number of write calls made to the terminal. */
+  uint64_t writes;
+
+  /* Time to open and to save a file, in ns. */
+  struct stats_histogram open_ns;
+  struct stats_histogram save_ns;
+
+  /* Number of calls to the line editing helpers. */
+  uint64_t edits;
+
+  /* Number of calls to malloc and calloc, and to realloc. Only counted with
+   * STATS set and glibc, whose allocator can be wrapped. The loader threads,
+   * the :s workers and the save thread allocate too, so they are counted
+   * atomically. */
+  uint64_t mallocs;
+  uint64_t reallocs;
+};
+
+extern struct stats stats;
+
+/* Returns the time of a monotonic clock in ns. */
+uint64_t stats_now();
+
+/* Adds the value to the histogram. */
+void stats_record(struct stats_histogram *h, uint64_t value);
+
+/* Writes a report of all the counters and histograms to buf, one line per
+ * item, truncated to fit in size. Percentiles are rounded up to the bucket
+ * boundary. Returns the length of the report. */
+int stats_report(char *buf, size_t size);
+
+/* Writes the report to the file at path. Returns -1 on failure. */
+int stats_dump(const char *path);
+
+#define STATS_COUNT(counter) stats.counter++
+
+#define STATS_RECORD(histogram, value) stats_record(&stats.histogram, value)
+
+/* Declares a timer named var started now, recorded by STATS_STOP. */
+#define STATS_START(var) uint64_t var = stats_now()
+
+#define STATS_STOP(histogram, var) STATS_RECORD(histogram, stats_now() - var)
+
+#endif /* _STATS_H_ */
@@ -0,0 +1,282 @@
+#include "swap.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Written at the start of swap files. */
+#define SWAP_MAGIC "VIPSWAP1"
+
+/* Records are written out early once this many bytes are kept in memory. */
+#define SWAP_BUFFER (1 << 16)
+
+/* Time by which the modification time of a file can lag behind the clock
+ * when it is written, in ns, as file times come from a coarser clock. */
+#define SWAP_CLOCK_SLACK 20000000ULL
+
+/* Start of a swap file: the file it applies to as it was when it was
+ * opened. */
+struct swap_header {
+  char magic[8];
+  uint64_t size;
+  uint64_t mtime;
+};
+
+static unsigned long long swap_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Stores the size and modification time in ns of the file at path in the
+ * header. A missing file has both set to 0. */
+static void swap_stat(const char *path, struct swap_header *header) {
+  struct stat st;
+  memcpy(header->magic, SWAP_MAGIC, sizeof(header->magic));
+  header->size = 0;
+  header->mtime = 0;
+  if (stat(path, &st) == 0) {
+    header->size = st.st_size;
+    header->mtime =
+        (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  }
+}
+
+char *swap_path(const char *path) {
+  const char *base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+  size_t dir = base - path;
+  char *swap = malloc(strlen(path) + sizeof(".swp") + 1);
+  memcpy(swap, path, dir);
+  sprintf(swap + dir, ".%s.swp", base);
+  return swap;
+}
+
+static struct swap *swap_new(char *path, int fd, size_t size) {
+  struct swap *sw = malloc(sizeof(struct swap));
+  unsigned long long now = swap_now();
+  *sw = (struct swap){path, fd, malloc(SWAP_BUFFER), 0, SWAP_BUFFER, size,
+                      now, now, 0, 0};
+  return sw;
+}
+
+struct swap *swap_create(const char *path) {
+  struct swap_header header;
+  swap_stat(path, &header);
+
+  char *swap = swap_path(path);
+  int fd = open(swap, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (fd == -1) {
+    free(swap);
+    return NULL;
+  }
+  if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+    close(fd);
+    unlink(swap);
+    free(swap);
+    return NULL;
+  }
+  return swap_new(swap, fd, sizeof(header));
+}
+
+struct swap *swap_open(const char *path, size_t len) {
+  char *swap = swap_path(path);
+  int fd = open(swap, O_WRONLY | O_APPEND);
+  if (fd == -1 || ftruncate(fd, len) == -1) {
+    if (fd != -1)
+      close(fd);
+    free(swap);
+    return NULL;
+  }
+  return swap_new(swap, fd, len);
+}
+
+static void swap_put(struct swap *sw, const void *p, size_t len) {
+  if (sw->len + len > sw->cap) {
+    while (sw->len + len > sw->cap)
+      sw->cap *= 2;
+    sw->buffer = realloc(sw->buffer, sw->cap);
+  }
+  memcpy(sw->buffer + sw->len, p, len);
+  sw->len += len;
+  sw->size += len;
+}
+
+/* Numbers take 7 bits per byte, so small ones take a single byte. */
+static void swap_put_number(struct swap *sw, size_t n) {
+  unsigned char bytes[10];
+  int len = 0;
+  do {
+    bytes[len] = n & 0x7f;
+    n >>= 7;
+    if (n)
+      bytes[len] |= 0x80;
+    len++;
+  } while (n);
+  swap_put(sw, bytes, len);
+}
+
+/* Writes out the records kept in memory, without waiting for them to reach
+ * the disk. After a failed write nothing more is written, so the swap file
+ * still holds the changes up to some point. */
+static void swap_flush(struct swap *sw) {
+  size_t done = 0;
+  while (done < sw->len && !sw->failed) {
+    ssize_t n = write(sw->fd, sw->buffer + done, sw->len - done);
+    if (n == -1 && errno != EINTR)
+      sw->failed = 1;
+    else if (n > 0)
+      done += n;
+  }
+  sw->unsynced |= sw->len > 0;
+  sw->len = 0;
+  sw->written = swap_now();
+}
+
+void swap_write(struct swap *sw, enum swap_op op, size_t a, size_t b,
+                size_t c, const char *text, size_t len) {
+  if (!sw)
+    return;
+
+  unsigned char byte = op;
+  swap_put(sw, &byte, 1);
+  swap_put_number(sw, a);
+  swap_put_number(sw, b);
+  swap_put_number(sw, c);
+  swap_put_number(sw, len);
+  if (len > 0)
+    swap_put(sw, text, len);
+
+  /* Records reach the disk in time even while changes keep coming. */
+  unsigned long long now = swap_now();
+  if (now - sw->synced >= SWAP_INTERVAL * 1000000ULL)
+    swap_sync(sw);
+  else if (sw->len >= SWAP_BUFFER ||
+           now - sw->written >= SWAP_INTERVAL * 1000000ULL)
+    swap_flush(sw);
+}
+
+size_t swap_offset(struct swap *sw) { return sw ? sw->size : 0; }
+
+int swap_pending(struct swap *sw) {
+  return sw && (sw->len > 0 || sw->unsynced);
+}
+
+void swap_sync(struct swap *sw) {
+  if (!sw)
+    return;
+  swap_flush(sw);
+  if (sw->unsynced && !sw->failed)
+    fdatasync(sw->fd);
+  sw->unsynced = 0;
+  sw->synced = swap_now();
+}
+
+void swap_close(struct swap *sw, int remove) {
+  if (!sw)
+    return;
+  swap_flush(sw);
+  close(sw->fd);
+  if (remove)
+    unlink(sw->path);
+  free(sw->path);
+  free(sw->buffer);
+  free(sw);
+}
+
+static int swap_get_number(struct swap_journal *j, size_t *n) {
+  *n = 0;
+  for (int shift = 0; j->pos < j->len && shift < 64; shift += 7) {
+    unsigned char byte = j->data[j->pos++];
+    *n |= (size_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return 1;
+  }
+  return 0;
+}
+
+int swap_next(struct swap_journal *j, struct swap_record *r) {
+  size_t start = j->pos;
+  if (j->pos < j->len) {
+    r->op = (unsigned char)j->data[j->pos++];
+    if (swap_get_number(j, &r->a) && swap_get_number(j, &r->b) &&
+        swap_get_number(j, &r->c) && swap_get_number(j, &r->len) &&
+        r->len <= j->len - j->pos) {
+      r->text = j->data + j->pos;
+      j->pos += r->len;
+      return 1;
+    }
+  }
+  j->pos = start;
+  return 0;
+}
+
+int swap_read(const char *path, struct swap_journal *j) {
+  char *swap = swap_path(path);
+  int fd = open(swap, O_RDONLY);
+  free(swap);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    if (fd != -1)
+      close(fd);
+    return -1;
+  }
+
+  *j = (struct swap_journal){malloc(st.st_size + 1), 0, 0};
+  ssize_t n;
+  while (j->len < (size_t)st.st_size &&
+         (n = read(fd, j->data + j->len, st.st_size - j->len)) != 0) {
+    if (n == -1 && errno != EINTR)
+      break;
+    if (n > 0)
+      j->len += n;
+  }
+  close(fd);
+
+  struct swap_header header, disk;
+  swap_stat(path, &disk);
+  if (j->len < sizeof(header)) {
+    swap_journal_free(j);
+    return -2;
+  }
+  memcpy(&header, j->data, sizeof(header));
+  j->pos = sizeof(header);
+  if (memcmp(header.magic, SWAP_MAGIC, sizeof(header.magic)) != 0) {
+    swap_journal_free(j);
+    return -2;
+  }
+
+  /* An unchanged file still needs every change. Otherwise it was written by
+   * the last completed save that started before it was modified, and only
+   * the changes made after that save started are missing. */
+  if (header.size == disk.size && header.mtime == disk.mtime)
+    return 0;
+
+  size_t start = 0;
+  struct swap_record r;
+  for (size_t pos = j->pos; swap_next(j, &r); pos = j->pos) {
+    if (r.op != SWAP_SAVE ||
+        r.a * 1000000000ULL + r.b > disk.mtime + SWAP_CLOCK_SLACK)
+      continue;
+    if (r.c == 0)
+      start = j->pos;
+    else if (r.c >= sizeof(header) && r.c <= pos)
+      start = r.c;
+  }
+  if (start == 0) {
+    swap_journal_free(j);
+    return -2;
+  }
+  j->pos = start;
+  return 0;
+}
+
+void swap_journal_free(struct swap_journal *j) {
+  free(j->data);
+  j->data = NULL;
+}
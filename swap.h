@@ -0,0 +1,151 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+#include <stddef.h>
+
+/* Longest time records are kept in memory before they are written to the
+ * swap file, and before they are flushed to disk, in milliseconds. They are
+ * also flushed once no change has been made for that long. */
+#ifndef SWAP_INTERVAL
+#define SWAP_INTERVAL 1000
+#endif
+
+/* Changes recorded in a swap file. Each is replayed by the editor function
+ * that made it, so undo steps come back as they were too. */
+enum swap_op {
+  /* Undo step c started with the cursor at a, b. */
+  SWAP_STEP = 1,
+
+  /* Text inserted at row a, column b, or c characters deleted from there. */
+  SWAP_INSERT_TEXT,
+  SWAP_DELETE_TEXT,
+
+  /* Row a split at column b, or joined with the row after it. */
+  SWAP_SPLIT,
+  SWAP_JOIN,
+
+  /* c rows deleted from row a. */
+  SWAP_DELETE_ROWS,
+
+  /* Text pasted at row a, column b. */
+  SWAP_PASTE,
+
+  /* Matches of the first c characters of the text replaced with the rest of
+   * it in rows a up to b, replacing every match of a row if c is odd. The
+   * length of the pattern is c / 2. */
+  SWAP_SUBSTITUTE,
+
+  /* Step a undone or redone, or the last one if a is 0. Undoing or redoing a
+   * step made before the last save is followed by the SWAP_ROWS records of
+   * the changes it made, for recovery to apply when it does not have the
+   * step. */
+  SWAP_UNDO,
+  SWAP_REDO,
+
+  /* Save of the file started at a seconds and b nanoseconds past the epoch
+   * completed. The changes made after it started are the records from offset
+   * c of the swap file on, or those after this record if c is 0. */
+  SWAP_SAVE,
+
+  /* c rows from row a yanked to the register. */
+  SWAP_YANK,
+
+  /* Lines of the register put c times below row a, or above it if b is
+   * set. */
+  SWAP_PUT,
+
+  /* Line a of the register, whose text is the record's, written when a save
+   * starts for recovery to start from there. The register is emptied first
+   * if a is 0. */
+  SWAP_REGISTER,
+
+  /* c rows from row a replaced by b rows, whose lines make up the text, each
+   * followed by a newline. */
+  SWAP_ROWS,
+};
+
+struct swap_record {
+  enum swap_op op;
+  size_t a;
+  size_t b;
+  size_t c;
+  const char *text;
+  size_t len;
+};
+
+/* Journal of the changes made to a file since it was opened, appended to a
+ * swap file next to it so that they can be recovered after a crash. Records
+ * are batched in memory and written out every SWAP_INTERVAL. */
+struct swap {
+  char *path;
+  int fd;
+
+  /* Records not written out yet. */
+  char *buffer;
+  size_t len;
+  size_t cap;
+
+  /* Size of the swap file once the records kept in memory are written. */
+  size_t size;
+
+  /* Time of the last write and of the last flush to disk, in ns of the
+   * monotonic clock, and whether the last write still has to be flushed. */
+  unsigned long long written;
+  unsigned long long synced;
+  int unsynced;
+
+  /* Set once a write failed, after which nothing more is written. */
+  int failed;
+};
+
+/* Records read back from a swap file. */
+struct swap_journal {
+  char *data;
+  size_t len;
+  size_t pos;
+};
+
+/* Returns the path of the swap file of the file at path, which is hidden in
+ * the same directory. The path is allocated with malloc. */
+char *swap_path(const char *path);
+
+/* Creates the swap file of the file at path, which must not exist yet, for the
+ * file as it is on disk. Returns NULL if it cannot be created. */
+struct swap *swap_create(const char *path);
+
+/* Opens the existing swap file of the file at path to add records to it after
+ * recovering them, cutting it to its first len bytes so that a record that was
+ * only partly written is dropped. Returns NULL if it cannot be opened. */
+struct swap *swap_open(const char *path, size_t len);
+
+/* Records a change. Does nothing if sw is NULL. */
+void swap_write(struct swap *sw, enum swap_op op, size_t a, size_t b,
+                size_t c, const char *text, size_t len);
+
+/* Returns the offset in the swap file of the next record written, or 0 if sw
+ * is NULL. */
+size_t swap_offset(struct swap *sw);
+
+/* Returns 1 if records have not been flushed to disk yet. */
+int swap_pending(struct swap *sw);
+
+/* Writes out the records kept in memory and flushes them to disk. */
+void swap_sync(struct swap *sw);
+
+/* Writes out the records and closes the swap file, deleting it if remove is
+ * set. */
+void swap_close(struct swap *sw, int remove);
+
+/* Reads the swap file of the file at path and skips to the records made after
+ * the file on disk was written: those since it was opened if it is
+ * unchanged, or those since the last completed save started. Returns -1 if
+ * there is no swap file and -2 if it does not match the file. */
+int swap_read(const char *path, struct swap_journal *j);
+
+/* Reads the next record. Returns 0 at the end of the journal or at a record
+ * that was only partly written. */
+int swap_next(struct swap_journal *j, struct swap_record *r);
+
+void swap_journal_free(struct swap_journal *j);
+
+#endif /* _SWAP_H_ */
@@ -0,0 +1,140 @@
+#include "editor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Regression tests. Keys are fed through the input path like in vip-bench,
+ * without a terminal, and the rows the file ends up with are checked. */
+
+#define TEST_ROWS 24
+#define TEST_COLS 80
+
+/* A file, the keys fed to it in turns, after each of which a save started by
+ * them is waited for, and the text the file has to end up with. */
+struct test_case {
+  const char *name;
+  const char *content;
+  const char *keys[12];
+  const char *expected;
+};
+
+static char test_dir[] = "/tmp/vip-test-XXXXXX";
+static char test_path[sizeof(test_dir) + 8];
+
+static void test_write(const char *content) {
+  FILE *fp = fopen(test_path, "w");
+  fputs(content, fp);
+  fclose(fp);
+}
+
+static void test_open(struct editor *E, int recover) {
+  *E = (struct editor){0};
+  editor_open_file(E, test_path);
+  file_load_wait(E->file);
+  editor_load(E);
+  editor_init_screen(E, TEST_ROWS, TEST_COLS);
+  editor_open_swap(E, recover);
+}
+
+static void test_feed(struct editor *E, const char *keys) {
+  size_t len = strlen(keys);
+  memcpy(E->input, keys, len);
+  E->input_start = 0;
+  E->input_len = len;
+  while (E->input_len > 0)
+    editor_process_input(E);
+  editor_check_save(E, 1);
+}
+
+/* Frees the editor, keeping its swap file as a crash would. */
+static void test_crash(struct editor *E) {
+  file_close(E->file);
+  swap_close(E->swap, 0);
+  undo_free(&E->undo);
+  for (size_t i = 0; i < E->register_len; i++)
+    file_line_free(&E->register_lines[i]);
+  free(E->register_lines);
+  search_free(&E->search);
+  search_free(&E->search_typed);
+  render_screen_free(&E->screen);
+  render_buffer_free(&E->render_buffer);
+}
+
+/* Returns 1 if the rows of the file, each followed by a newline, are the
+ * expected text. */
+static int test_rows(struct editor *E, const char *expected) {
+  for (size_t row = 0; row < E->file->len; row++) {
+    struct line *line = file_line(E->file, row);
+    if (strncmp(expected, line->chars, line->len) != 0 ||
+        expected[line->len] != '\n')
+      return 0;
+    expected += line->len + 1;
+  }
+  return *expected == '\0';
+}
+
+/* Runs the keys, then recovers what they did from the swap file as if the
+ * editor had crashed, which has to give the same rows. */
+static int test_recover(struct test_case *test) {
+  struct editor E;
+  test_write(test->content);
+  test_open(&E, 0);
+  for (int i = 0; test->keys[i]; i++)
+    test_feed(&E, test->keys[i]);
+  int done = test_rows(&E, test->expected);
+  test_crash(&E);
+
+  test_open(&E, 1);
+  int recovered = test_rows(&E, test->expected);
+  test_crash(&E);
+  char *swap = swap_path(test_path);
+  unlink(swap);
+  free(swap);
+
+  if (!done || !recovered)
+    printf("%s: %s\n", test->name,
+           done ? "recovered rows differ" : "unexpected rows");
+  return done && recovered;
+}
+
+int main() {
+  if (!mkdtemp(test_dir)) {
+    fprintf(stderr, "vip-test: cannot create directory\n");
+    return 1;
+  }
+  snprintf(test_path, sizeof(test_path), "%s/file", test_dir);
+
+  /* Undoing or redoing steps made before a save, which recovery starts
+   * from, and editing after it. */
+  struct test_case tests[] = {
+      {"save-undo-edit",
+       "one\ntwo\n",
+       {"ihello\033", ":w\r", "u", "jAxyz\033"},
+       "one\ntwoxyz\n"},
+      {"save-undo-redo-edit",
+       "one\ntwo\n",
+       {"ihello\033", ":w\r", "u", "\x12", "jAxyz\033"},
+       "helloone\ntwoxyz\n"},
+      {"save-undo-rows",
+       "a\nb\nc\nd\ne\n",
+       {"dd", "jx", "2dd", ":w\r", "3u", "jAq\033", "u", "\x12"},
+       "a\nbq\nc\nd\ne\n"},
+      {"save-redo-rows",
+       "a\nb\nc\nd\n",
+       {"dd", "2dd", "u", "u", ":w\r", "\x12", "\x12", "Az\033", "u"},
+       "d\n"},
+      {"save-undo-substitute",
+       "aaa\nbab\n",
+       {":%s/a/XY/g\r", ":w\r", "u", "x", "u", "u", "\x12"},
+       "aa\nbab\n"},
+  };
+  int n = sizeof(tests) / sizeof(tests[0]), failed = 0;
+  for (int i = 0; i < n; i++)
+    failed += !test_recover(&tests[i]);
+
+  unlink(test_path);
+  rmdir(test_dir);
+  printf("%d of %d tests passed\n", n - failed, n);
+  return failed > 0;
+}
@@ -0,0 +1,358 @@
+#include "undo.h"
+#include "edit.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Size of the chunks that text is appended to. Texts longer than a quarter of
+ * it get a chunk of their own. */
+#define UNDO_CHUNK 65536
+
+struct undo_chunk {
+  size_t used;
+  size_t cap;
+
+  /* Number of records with text in the chunk. */
+  size_t refs;
+
+  char text[];
+};
+
+/* Returns the memory used by the lines, counting shared characters in
+ * full. */
+static size_t undo_lines_memory(struct line *lines, size_t len) {
+  size_t memory = sizeof(struct line) * len;
+  for (size_t i = 0; i < len; i++)
+    memory += lines[i].cap == LINE_SHARED ? lines[i].len + 1 : lines[i].cap;
+  return memory;
+}
+
+static void undo_lines_free(struct line *lines, size_t len) {
+  for (size_t i = 0; i < len; i++)
+    file_line_free(&lines[i]);
+  free(lines);
+}
+
+static void undo_chunk_free(struct undo *u, struct undo_chunk *chunk) {
+  u->memory -= sizeof(struct undo_chunk) + chunk->cap;
+  free(chunk);
+}
+
+/* Copies len characters of s to a chunk, which the record then refers to. */
+static void undo_store(struct undo *u, struct undo_record *r, const char *s,
+                       size_t len) {
+  struct undo_chunk *chunk = u->chunk;
+  if (len > UNDO_CHUNK / 4 || !chunk || chunk->cap - chunk->used < len) {
+    size_t cap = len > UNDO_CHUNK / 4 ? len : UNDO_CHUNK;
+    chunk = malloc(sizeof(struct undo_chunk) + cap);
+    chunk->used = 0;
+    chunk->cap = cap;
+    chunk->refs = 0;
+    u->memory += sizeof(struct undo_chunk) + cap;
+
+    if (cap == UNDO_CHUNK) {
+      if (u->chunk && u->chunk->refs == 0)
+        undo_chunk_free(u, u->chunk);
+      u->chunk = chunk;
+    }
+  }
+
+  r->text = chunk->text + chunk->used;
+  r->chunk = chunk;
+  r->len = len;
+  memcpy(r->text, s, len);
+  chunk->used += len;
+  chunk->refs++;
+}
+
+/* Updates the memory counted for the record after what it holds changed. */
+static void undo_measure(struct undo *u, struct undo_record *r) {
+  size_t memory = sizeof(struct undo_record);
+  if (r->lines)
+    memory += undo_lines_memory(r->lines, r->len);
+  if (r->rows)
+    memory += sizeof(size_t) * r->len;
+  u->memory = u->memory - r->memory + memory;
+  r->memory = memory;
+}
+
+static void undo_record_free(struct undo *u, struct undo_record *r) {
+  if (r->chunk && --r->chunk->refs == 0 && r->chunk != u->chunk)
+    undo_chunk_free(u, r->chunk);
+  if (r->lines)
+    undo_lines_free(r->lines, r->len);
+  free(r->rows);
+  u->memory -= r->memory;
+}
+
+/* Forgets the oldest steps until the journal fits in UNDO_MEMORY. The current
+ * step goes as well if it does not fit on its own, and the rest of its
+ * changes are not recorded. */
+static void undo_trim(struct undo *u) {
+  while (u->memory > UNDO_MEMORY && u->first < u->len) {
+    size_t end = u->first + 1;
+    while (end < u->len && !u->records[end].start)
+      end++;
+    if (end == u->len)
+      u->dropped = 1;
+
+    for (size_t i = u->first; i < end; i++)
+      undo_record_free(u, &u->records[i]);
+    u->first = end;
+  }
+
+  /* Records are moved back to the start once half of the array is unused. */
+  if (u->first > 0 && u->first >= u->len / 2) {
+    memmove(u->records, &u->records[u->first],
+            sizeof(struct undo_record) * (u->len - u->first));
+    u->len -= u->first;
+    u->done -= u->first;
+    u->first = 0;
+  }
+}
+
+/* Returns the last record if more changes can be merged into it. */
+static struct undo_record *undo_last(struct undo *u) {
+  if (u->step || u->dropped || u->done == u->first || u->done < u->len)
+    return NULL;
+  return &u->records[u->done - 1];
+}
+
+/* Returns 1 if len more characters can be appended to the text of the
+ * record. */
+static int undo_can_append(struct undo *u, struct undo_record *r, size_t len) {
+  struct undo_chunk *chunk = u->chunk;
+  return r->chunk == chunk && r->text + r->len == chunk->text + chunk->used &&
+         chunk->cap - chunk->used >= len;
+}
+
+/* Adds a record for a change, replacing the steps that were undone, and
+ * returns it. Returns NULL if the current step is not recorded. */
+static struct undo_record *undo_add(struct undo *u, enum undo_kind kind,
+                                    size_t row, size_t col) {
+  int start = u->step || u->done == u->first;
+  if (u->step) {
+    u->step = 0;
+    u->dropped = 0;
+  } else if (u->dropped) {
+    return NULL;
+  }
+
+  for (size_t i = u->done; i < u->len; i++)
+    undo_record_free(u, &u->records[i]);
+  u->len = u->done;
+
+  if (u->len == u->cap) {
+    u->cap = u->cap ? u->cap * 2 : 64;
+    u->records = realloc(u->records, sizeof(struct undo_record) * u->cap);
+  }
+  struct undo_record *r = &u->records[u->len++];
+  u->done = u->len;
+  *r = (struct undo_record){kind, start, u->step_row, u->step_col, u->step_id,
+                            row,  col};
+  undo_measure(u, r);
+  return r;
+}
+
+void undo_step(struct undo *u, size_t row, size_t col, size_t id) {
+  u->step = 1;
+  u->step_row = row;
+  u->step_col = col;
+  u->step_id = id;
+}
+
+void undo_insert_text(struct undo *u, size_t row, size_t col, const char *s,
+                      size_t len) {
+  struct undo_record *r = undo_last(u);
+  if (r && r->kind == UNDO_INSERT_TEXT && r->row == row &&
+      r->col + r->len == col && undo_can_append(u, r, len)) {
+    memcpy(r->text + r->len, s, len);
+    u->chunk->used += len;
+    r->len += len;
+    return;
+  }
+
+  r = undo_add(u, UNDO_INSERT_TEXT, row, col);
+  if (!r)
+    return;
+  undo_store(u, r, s, len);
+  undo_trim(u);
+}
+
+void undo_delete_text(struct undo *u, size_t row, size_t col, const char *s,
+                      size_t len) {
+  struct undo_record *r = undo_last(u);
+
+  /* Deleting characters that were just typed takes them out of the
+   * insertion. */
+  if (r && r->kind == UNDO_INSERT_TEXT && r->row == row && col >= r->col &&
+      col + len == r->col + r->len) {
+    if (undo_can_append(u, r, 0))
+      u->chunk->used -= len;
+    r->len -= len;
+    return;
+  }
+
+  /* Deletions at the same position, such as repeated x, are recorded
+   * together. */
+  if (r && r->kind == UNDO_DELETE_TEXT && r->row == row && r->col == col &&
+      undo_can_append(u, r, len)) {
+    memcpy(r->text + r->len, s, len);
+    u->chunk->used += len;
+    r->len += len;
+    return;
+  }
+
+  r = undo_add(u, UNDO_DELETE_TEXT, row, col);
+  if (!r)
+    return;
+  undo_store(u, r, s, len);
+  undo_trim(u);
+}
+
+void undo_split(struct undo *u, size_t row, size_t col) {
+  undo_add(u, UNDO_SPLIT, row, col);
+  undo_trim(u);
+}
+
+void undo_join(struct undo *u, size_t row, size_t col) {
+  undo_add(u, UNDO_JOIN, row, col);
+  undo_trim(u);
+}
+
+void undo_rows(struct undo *u, size_t row, struct line *lines, size_t len,
+               size_t count) {
+  struct undo_record *r = undo_add(u, UNDO_ROWS, row, 0);
+  if (!r) {
+    undo_lines_free(lines, len);
+    return;
+  }
+  r->lines = lines;
+  r->len = len;
+  r->count = count;
+  undo_measure(u, r);
+  undo_trim(u);
+}
+
+void undo_set_rows(struct undo *u, size_t *rows, struct line *lines,
+                   size_t len) {
+  struct undo_record *r =
+      undo_add(u, UNDO_SET_ROWS, len > 0 ? rows[0] : 0, 0);
+  if (!r) {
+    undo_lines_free(lines, len);
+    free(rows);
+    return;
+  }
+  r->lines = lines;
+  r->rows = rows;
+  r->len = len;
+  undo_measure(u, r);
+  undo_trim(u);
+}
+
+/* Makes the change of the record again, or takes it back if forward is 0, and
+ * reports it to changed if it is set. */
+static void undo_apply(struct undo *u, struct file *f, struct undo_record *r,
+                       int forward, undo_changed *changed, void *arg) {
+  switch (r->kind) {
+  case UNDO_INSERT_TEXT:
+  case UNDO_DELETE_TEXT:
+    if ((r->kind == UNDO_INSERT_TEXT) == forward)
+      edit_insert_string(file_line(f, r->row), r->col, r->text, r->len);
+    else
+      edit_delete_string(file_line(f, r->row), r->col, r->len);
+    if (changed)
+      changed(arg, r->row, 1, 1);
+    break;
+  case UNDO_SPLIT:
+  case UNDO_JOIN:
+    if ((r->kind == UNDO_SPLIT) == forward) {
+      file_split_row(f, r->row, r->col);
+      if (changed)
+        changed(arg, r->row, 1, 2);
+    } else {
+      struct line *line = file_line(f, r->row);
+      struct line *next = file_line(f, r->row + 1);
+      edit_append_string(line, next->chars, next->len);
+      file_delete_row(f, r->row + 1);
+      if (changed)
+        changed(arg, r->row, 2, 1);
+    }
+    break;
+  case UNDO_ROWS: {
+    /* The held lines go back in one insertion and the rows that replaced
+     * them come out in one deletion, so the record is the same change the
+     * other way around. */
+    struct line *lines = malloc(sizeof(struct line) * r->count);
+    file_insert_rows(f, r->row, r->lines, r->len);
+    file_take_rows(f, r->row + r->len, r->count, lines);
+    free(r->lines);
+    r->lines = lines;
+    size_t len = r->len;
+    r->len = r->count;
+    r->count = len;
+    undo_measure(u, r);
+    if (changed)
+      changed(arg, r->row, r->len, r->count);
+    break;
+  }
+  case UNDO_SET_ROWS: {
+    size_t first = 0, n = 0;
+    struct line *lines = NULL;
+    for (size_t i = 0; i < r->len; i++) {
+      if (r->rows[i] >= first + n) {
+        first = r->rows[i];
+        lines = file_lines(f, first, &n);
+      }
+      struct line *line = &lines[r->rows[i] - first];
+      struct line held = r->lines[i];
+      file_line_changed(line);
+      r->lines[i] = *line;
+      *line = held;
+      if (changed)
+        changed(arg, r->rows[i], 1, 1);
+    }
+    undo_measure(u, r);
+    break;
+  }
+  }
+}
+
+size_t undo_next(struct undo *u, int redo) {
+  if (redo)
+    return u->done < u->len ? u->records[u->done].step : 0;
+  return u->done > u->first ? u->records[u->done - 1].step : 0;
+}
+
+int undo_undo(struct undo *u, struct file *f, size_t *row, size_t *col,
+              undo_changed *changed, void *arg) {
+  if (u->done == u->first)
+    return 0;
+
+  do
+    undo_apply(u, f, &u->records[--u->done], 0, changed, arg);
+  while (u->done > u->first && !u->records[u->done].start);
+  *row = u->records[u->done].cursor_row;
+  *col = u->records[u->done].cursor_col;
+  return 1;
+}
+
+int undo_redo(struct undo *u, struct file *f, size_t *row, size_t *col,
+              undo_changed *changed, void *arg) {
+  if (u->done == u->len)
+    return 0;
+
+  *row = u->records[u->done].row;
+  *col = u->records[u->done].col;
+  do
+    undo_apply(u, f, &u->records[u->done++], 1, changed, arg);
+  while (u->done < u->len && !u->records[u->done].start);
+  return 1;
+}
+
+void undo_free(struct undo *u) {
+  for (size_t i = u->first; i < u->len; i++)
+    undo_record_free(u, &u->records[i]);
+  free(u->records);
+  free(u->chunk);
+  *u = (struct undo){0};
+}
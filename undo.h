@@ -0,0 +1,154 @@
+#ifndef _UNDO_H_
+#define _UNDO_H_
+
+#include "file.h"
+
+/* Most memory kept to undo changes, in bytes. The oldest steps are forgotten
+ * to stay below it. */
+#ifndef UNDO_MEMORY
+#define UNDO_MEMORY ((size_t)64 << 20)
+#endif
+
+/* Block of memory that the text of text changes is appended to, so that a run
+ * of typed characters needs no allocation of its own. */
+struct undo_chunk;
+
+enum undo_kind {
+  /* Text inserted into the row at col, or deleted from it. */
+  UNDO_INSERT_TEXT,
+  UNDO_DELETE_TEXT,
+
+  /* Row split at col, or joined with the row after it, which was appended at
+   * col. */
+  UNDO_SPLIT,
+  UNDO_JOIN,
+
+  /* Rows replaced as a whole: the lines held by the record were replaced by
+   * the count rows now at row. Undoing it swaps them back, so the record then
+   * holds the rows it took out. */
+  UNDO_ROWS,
+
+  /* Rows changed in place. The record holds the other version of each, and
+   * undoing it swaps them back. */
+  UNDO_SET_ROWS,
+};
+
+/* Change made to a file, with what it takes to make it again or take it
+ * back. */
+struct undo_record {
+  enum undo_kind kind;
+
+  /* Set on the first record of each step, which stores where the cursor was
+   * before the step. Every record stores the id of its step. */
+  int start;
+  size_t cursor_row;
+  size_t cursor_col;
+  size_t step;
+
+  size_t row;
+  size_t col;
+
+  /* Characters of text changes, stored in chunk. */
+  char *text;
+  struct undo_chunk *chunk;
+
+  /* Lines held by row changes, and for UNDO_SET_ROWS the rows each belongs
+   * to. */
+  struct line *lines;
+  size_t *rows;
+
+  /* Number of characters of text changes, or of lines held by row
+   * changes. */
+  size_t len;
+  size_t count;
+
+  /* Memory used by the record and what it holds. */
+  size_t memory;
+};
+
+/* Journal of the changes made to a file, grouped in steps that are undone and
+ * redone as a whole. Changes are recorded as they are made, together with
+ * what it takes to reverse them, so undoing deleted rows puts the same lines
+ * back in a single insertion instead of copying them. */
+struct undo {
+  /* Records from first up to done are applied to the file, and those from
+   * done up to len were undone and can be redone. */
+  struct undo_record *records;
+  size_t first;
+  size_t done;
+  size_t len;
+  size_t cap;
+
+  /* Chunk that text is currently appended to. */
+  struct undo_chunk *chunk;
+
+  /* Memory used by the records and chunks. */
+  size_t memory;
+
+  /* Set when the next change starts a step, with the cursor position before
+   * it and the id of the step. */
+  int step;
+  size_t step_row;
+  size_t step_col;
+  size_t step_id;
+
+  /* Set when the current step took more than UNDO_MEMORY and its changes are
+   * no longer recorded. */
+  int dropped;
+};
+
+/* Starts a step: the changes recorded from now on are undone together. The
+ * cursor goes back to the provided position when the step is undone. The id
+ * is the caller's, to tell steps apart. */
+void undo_step(struct undo *u, size_t row, size_t col, size_t id);
+
+/* Records that len characters of s were inserted at the provided position.
+ * Characters typed one after the other are recorded together. */
+void undo_insert_text(struct undo *u, size_t row, size_t col, const char *s,
+                      size_t len);
+
+/* Records that the len characters of s at the provided position are about to
+ * be deleted. */
+void undo_delete_text(struct undo *u, size_t row, size_t col, const char *s,
+                      size_t len);
+
+/* Records that the row was split at col. */
+void undo_split(struct undo *u, size_t row, size_t col);
+
+/* Records that the row after the provided row was appended to it at col. */
+void undo_join(struct undo *u, size_t row, size_t col);
+
+/* Records that the len provided lines were replaced by count rows at the
+ * provided row. The journal takes ownership of the lines and the array. */
+void undo_rows(struct undo *u, size_t row, struct line *lines, size_t len,
+               size_t count);
+
+/* Records that len rows were changed in place, where lines holds their
+ * previous versions and rows the rows they are on, in order. The journal
+ * takes ownership of the lines and both arrays. */
+void undo_set_rows(struct undo *u, size_t *rows, struct line *lines,
+                   size_t len);
+
+/* Called for each change made by undoing or redoing a step, with the removed
+ * rows at row replaced by the added rows now there. */
+typedef void undo_changed(void *arg, size_t row, size_t removed, size_t added);
+
+/* Returns the id of the step that undo_undo, or undo_redo if redo is set,
+ * would apply next. Returns 0 if there is none. */
+size_t undo_next(struct undo *u, int redo);
+
+/* Undoes the last step that was not undone yet and stores where the cursor
+ * was before it in *row and *col. Each change is reported to changed, unless
+ * it is NULL. Returns 0 if there is none. */
+int undo_undo(struct undo *u, struct file *f, size_t *row, size_t *col,
+              undo_changed *changed, void *arg);
+
+/* Redoes the last step that was undone and stores where it starts in *row
+ * and *col. Each change is reported to changed, unless it is NULL. Returns 0
+ * if there is none. */
+int undo_redo(struct undo *u, struct file *f, size_t *row, size_t *col,
+              undo_changed *changed, void *arg);
+
+void undo_free(struct undo *u);
+
+#endif /* _UNDO_H_ */